@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#include <atomic>
+#include <sched.h> // for getcpu()
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "arena.h"
+#include "pages.h"
+#include "log.h"
+
+// from numaif.h, which may not be installed
+#define MPOL_PREFERRED 1
+
+// global variables
+size_t sNumArenas = 1;
+// numa node of each arena
+static size_t sArenaNodes[ARENA_MAX];
+// arena of each node, nodes beyond ARENA_MAX share arenas
+static uint8_t sNodeArenas[ARENA_MAX_NODES];
+// arena map root, middle nodes and leaves are allocated on demand
+// only used if sNumArenas > 1
+typedef std::atomic<uint8_t*> ArenaLeaf;
+static std::atomic<ArenaLeaf*> sArenaMap[1ULL << AM_L1_BITS];
+
+#if ARENA_NUMA && ARENA_FAKE_NODES == 0
+// parses a numa node list, in increasing id order
+// format is a list of ranges, such as "0", "0-3" or "0-1,4"
+// returns number of nodes found, ids stored in `nodes`
+// ids past max don't fit in the node tables, and are skipped
+static size_t ParseNodeList(char const* buf, size_t len, uint16_t* nodes,
+        size_t max)
+{
+    size_t numNodes = 0;
+    size_t first = 0;
+    size_t num = 0;
+    bool inNum = false;
+    bool inRange = false;
+    for (size_t i = 0; i <= len; ++i)
+    {
+        char c = (i < len) ? buf[i] : '\n';
+        if (c >= '0' && c <= '9')
+        {
+            num = (inNum ? num * 10 : 0) + (c - '0');
+            inNum = true;
+            continue;
+        }
+
+        if (!inNum)
+            continue;
+
+        inNum = false;
+        if (c == '-')
+        {
+            first = num;
+            inRange = true;
+            continue;
+        }
+
+        // end of a single node or of a range
+        if (!inRange)
+            first = num;
+
+        for (size_t node = first; node <= num && node < max; ++node)
+            nodes[numNodes++] = (uint16_t)node;
+
+        inRange = false;
+    }
+
+    return numNodes;
+}
+
+// reads online numa nodes from sysfs
+// can't use stdio, it may call malloc
+static size_t GetOnlineNodes(uint16_t* nodes, size_t max)
+{
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    char buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len <= 0)
+        return 0;
+
+    return ParseNodeList(buf, len, nodes, max);
+}
+#endif
+
+void ArenaInit()
+{
+#if ARENA_NUMA
+    uint16_t nodes[ARENA_MAX_NODES];
+#if ARENA_FAKE_NODES > 0
+    size_t numNodes = ARENA_FAKE_NODES;
+    for (size_t i = 0; i < numNodes; ++i)
+        nodes[i] = (uint16_t)i;
+#else
+    size_t numNodes = GetOnlineNodes(nodes, ARENA_MAX_NODES);
+#endif
+
+    // node ids may be sparse, arenas are assigned in id order
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        sNodeArenas[nodes[i]] = (uint8_t)(i % ARENA_MAX);
+        if (i < ARENA_MAX)
+            sArenaNodes[i] = nodes[i];
+    }
+
+    sNumArenas = numNodes < ARENA_MAX ? numNodes : ARENA_MAX;
+    if (sNumArenas == 0)
+        sNumArenas = 1;
+#endif
+}
+
+size_t GetCurrentArena()
+{
+    if (sNumArenas == 1)
+        return 0;
+
+    unsigned cpu, node;
+    if (UNLIKELY(getcpu(&cpu, &node) != 0))
+        return 0;
+
+#if ARENA_FAKE_NODES > 0
+    node = cpu % ARENA_FAKE_NODES;
+#endif
+    return node < ARENA_MAX_NODES ? sNodeArenas[node] : 0;
+}
+
+size_t GetArenaNode(size_t arena)
+{
+    ASSERT(arena < sNumArenas);
+    return sArenaNodes[arena];
+}
+
+size_t GetArenaForPtr(char* ptr)
+{
+    if (sNumArenas == 1)
+        return 0;
+
+    size_t key = (size_t)ptr >> LG_HUGEPAGE;
+    size_t l1 = key >> (AM_L2_BITS + AM_L3_BITS);
+    size_t l2 = (key >> AM_L3_BITS) & ((1ULL << AM_L2_BITS) - 1);
+    size_t l3 = key & ((1ULL << AM_L3_BITS) - 1);
+
+    // chunk was recorded before any of its blocks was published
+    ArenaLeaf* mid = sArenaMap[l1].load(std::memory_order_acquire);
+    uint8_t* leaf = LIKELY(mid != nullptr) ?
+        mid[l2].load(std::memory_order_acquire) : nullptr;
+    ASSERT(leaf);
+    return LIKELY(leaf != nullptr) ? leaf[l3] : 0;
+}
+
+// returns arena map leaf covering huge page key, installing it if needed
+static uint8_t* GetArenaLeaf(size_t key)
+{
+    size_t l1 = key >> (AM_L2_BITS + AM_L3_BITS);
+    size_t l2 = (key >> AM_L3_BITS) & ((1ULL << AM_L2_BITS) - 1);
+
+    // nodes are given by the OS, so they're already zero'd
+    ArenaLeaf* mid = sArenaMap[l1].load(std::memory_order_acquire);
+    if (mid == nullptr)
+    {
+        ArenaLeaf* newMid = (ArenaLeaf*)PageAlloc(AM_L2_SZ);
+        if (UNLIKELY(newMid == nullptr))
+            abort();
+
+        if (sArenaMap[l1].compare_exchange_strong(mid, newMid))
+            mid = newMid;
+        else
+            PageFree(newMid, AM_L2_SZ); // lost race, use winner's node
+    }
+
+    uint8_t* leaf = mid[l2].load(std::memory_order_acquire);
+    if (leaf == nullptr)
+    {
+        uint8_t* newLeaf = (uint8_t*)PageAlloc(AM_L3_SZ);
+        if (UNLIKELY(newLeaf == nullptr))
+            abort();
+
+        if (mid[l2].compare_exchange_strong(leaf, newLeaf))
+            leaf = newLeaf;
+        else
+            PageFree(newLeaf, AM_L3_SZ);
+    }
+
+    return leaf;
+}
+
+void SetArenaForChunk(char* ptr, size_t size, size_t arena)
+{
+    if (sNumArenas == 1)
+        return;
+
+    ASSERT(arena < sNumArenas);
+    ASSERT(((size_t)ptr & HUGEPAGE_MASK) == 0);
+    size_t first = (size_t)ptr >> LG_HUGEPAGE;
+    size_t last = ((size_t)ptr + size - 1) >> LG_HUGEPAGE;
+    for (size_t key = first; key <= last; ++key)
+        GetArenaLeaf(key)[key & ((1ULL << AM_L3_BITS) - 1)] = (uint8_t)arena;
+
+#if ARENA_FAKE_NODES == 0
+    // only a preference, allocation falls back to other nodes when
+    //  this node runs out of memory
+    // failure is harmless, memory is just placed by first touch
+    size_t const wordBits = sizeof(unsigned long) * 8;
+    unsigned long nodeMask[ARENA_MAX_NODES / wordBits] = { };
+    size_t node = sArenaNodes[arena];
+    nodeMask[node / wordBits] = 1UL << (node % wordBits);
+    // kernel reads maxnode - 1 bits
+    syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, nodeMask,
+            sizeof(nodeMask) * 8 + 1, 0);
+#endif
+}
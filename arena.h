@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include "defines.h"
+#include "pagemap.h" // for PM_ADDR_BITS
+
+// numa arenas
+// each numa node has its own arena, with its own block tree, and chunks
+//  bound to the node's memory
+// if ARENA_NUMA = 0, a single arena is used
+#ifndef ARENA_NUMA
+#define ARENA_NUMA 1
+#endif
+// max number of arenas, nodes beyond this share arenas
+#define ARENA_MAX 8
+// max numa node id + 1, nodes with larger ids use arena 0
+// same as the kernel's largest MAX_NUMNODES
+#define ARENA_MAX_NODES 1024
+// if > 0, emulates this many numa nodes, with cpu i in node
+//  i % ARENA_FAKE_NODES
+// chunks aren't bound to any node in this mode, meant for testing
+#ifndef ARENA_FAKE_NODES
+#define ARENA_FAKE_NODES 0
+#endif
+
+// arena map, records the arena of each huge page
+// chunks are HUGEPAGE aligned, so a huge page never holds chunks
+//  of different arenas
+// implemented as a lock-free 3-level radix tree over huge page numbers,
+//  like the radix page map, so only address ranges that hold chunks
+//  take memory
+#define AM_SB (PM_ADDR_BITS - LG_HUGEPAGE)
+// leaves cover 2^AM_L3_BITS huge pages, a page worth of arena indices
+#define AM_L3_BITS LG_PAGE
+#define AM_L2_BITS ((AM_SB - AM_L3_BITS) / 2)
+#define AM_L1_BITS (AM_SB - AM_L2_BITS - AM_L3_BITS)
+#define AM_L3_SZ ((1ULL << AM_L3_BITS) * sizeof(uint8_t))
+#define AM_L2_SZ PAGE_CEILING((1ULL << AM_L2_BITS) * sizeof(void*))
+
+// number of arenas in use, set by ArenaInit
+extern size_t sNumArenas;
+
+// detects online numa nodes, and assigns them to arenas
+// must be called before any other arena function
+void ArenaInit();
+// arena for the node of the cpu the calling thread runs on
+size_t GetCurrentArena();
+// arena that owns chunk containing ptr
+size_t GetArenaForPtr(char* ptr);
+// numa node whose memory backs chunks of arena
+size_t GetArenaNode(size_t arena);
+// records arena of a chunk and binds its memory to the arena's node
+void SetArenaForChunk(char* ptr, size_t size, size_t arena);
+
+#endif // __ARENA_H
@@ -4,12 +4,16 @@
  */
 
 #include <cstring> // for memset/memcpy
+#include <algorithm> // for max()
 
 // for ENOMEM
 #include <errno.h>
+#include <new> // for operator new/delete
 
 #include "cmalloc.h"
 #include "internal.h"
+#include "slab.h"
+#include "tcache.h"
 #include "log.h"
 
 // global variables
@@ -26,8 +30,8 @@ void InitMalloc()
     // init page map
     sPageMap.Init();
 
-    // init block tree
-    sTree = LFBSTree();
+    // init block trees
+    InitArenas();
 }
 
 void c_malloc_initialize() { }
@@ -36,7 +40,21 @@ void c_malloc_finalize() { }
 
 void c_malloc_thread_initialize() { }
 
-void c_malloc_thread_finalize() { }
+void c_malloc_thread_finalize()
+{
+    // drain thread caches
+    // slab flush may release superblocks to block cache, so flush it first
+    SlabFlush();
+    TCacheFlush();
+    // purge queue is thread-local, purge pending blocks now
+    PurgeBlocks(true);
+    // hand off retired tree nodes to other threads
+    // tree nodes are also used by block free lists
+    LFBSTree::ThreadFinalize();
+#if BLOCK_INDEX == BLOCK_INDEX_SKIPLIST
+    LFSkipList::ThreadFinalize();
+#endif
+}
 
 extern "C"
 void* c_malloc(size_t size) noexcept
@@ -47,9 +65,24 @@ void* c_malloc(size_t size) noexcept
     if (UNLIKELY(!MallocInit))
         InitMalloc();
 
+    // small object allocation
+    if (LIKELY(size <= SLAB_MAX_SIZE))
+    {
+        void* ptr = SlabAlloc(size);
+        LOG_DEBUG("ptr: %p", ptr);
+        return ptr;
+    }
+
     // large block allocation
+    // page rounding may wrap around
+    if (UNLIKELY(size > SIZE_MAX - PAGE))
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
     size_t pages = PAGE_CEILING(size);
-    char* ptr = AllocBlock(pages);
+    char* ptr = TCacheAlloc(pages);
     LOG_DEBUG("ptr: %p", ptr);
     return (void*)ptr;
 }
@@ -64,11 +97,27 @@ void* c_calloc(size_t n, size_t size) noexcept
     if (UNLIKELY(n == 0 || allocSize / n != size))
         return nullptr;
 
-    void* ptr = c_malloc(allocSize);
-
     // calloc returns zero-filled memory
-    // @todo: optimize, memory may be already zero-filled 
-    //  if coming directly from OS
+    // blocks too large for the thread cache may be fresh from the OS
+    //  or purged, and so already zero-filled
+    size_t blockSize = PAGE_CEILING(allocSize);
+    if (blockSize > TCACHE_MAX_PAGES * PAGE)
+    {
+        // ensure malloc is initialized
+        if (UNLIKELY(!MallocInit))
+            InitMalloc();
+
+        // direct blocks are fresh from the OS
+        bool zeroed = IsDirectSize(blockSize);
+        void* ptr = zeroed ? AllocChunkBlock(blockSize, true) :
+            AllocBlock(blockSize, HUGEPAGE, &zeroed);
+        if (LIKELY(ptr != nullptr) && !zeroed)
+            memset(ptr, 0x0, allocSize);
+
+        return ptr;
+    }
+
+    void* ptr = c_malloc(allocSize);
     if (LIKELY(ptr != nullptr))
         memset(ptr, 0x0, allocSize);
 
@@ -80,12 +129,20 @@ void* c_realloc(void* ptr, size_t size) noexcept
 {
     LOG_DEBUG();
 
+    // page rounding may wrap around, and a 0 size would free the block
+    if (UNLIKELY(size > SIZE_MAX - PAGE))
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
     size_t blockSize = 0;
+    size_t newSize = PAGE_CEILING(size);
     if (LIKELY(ptr != nullptr))
     {
         PageInfo info = GetPageInfoForPtr((char*)ptr);
-        ASSERT(info.size > 0);
-        blockSize = info.size;
+        ASSERT(info.GetSize() > 0);
+        blockSize = info.IsSlab() ? SlabUsableSize(info) : info.GetSize();
 
         // realloc with size == 0 is the same as free(ptr)
         if (UNLIKELY(size == 0))
@@ -94,12 +151,31 @@ void* c_realloc(void* ptr, size_t size) noexcept
             return nullptr;
         }
 
+        // try to grow or shrink by at least a page in place
+        // slabs have fixed-size objects, can't be resized
+        if (!info.IsSlab() && newSize != blockSize &&
+                ResizeBlock(TKey(blockSize, (char*)ptr), newSize))
+            return ptr;
+
         // nothing to do, block is already large enough
         if (UNLIKELY(size <= blockSize))
             return ptr;
+
+        // very large blocks are moved without copying, if they are
+        //  backed by their own chunk
+        if (!info.IsSlab() &&
+                (blockSize >= REMAP_MIN_SIZE || info.IsDirect()))
+        {
+            char* remapped = RemapBlock(TKey(blockSize, (char*)ptr), newSize);
+            if (remapped)
+                return remapped;
+        }
     }
 
-    void* newPtr = c_malloc(size);
+    // growing very large blocks get their own chunk, so they can be
+    //  remapped next time they grow
+    void* newPtr = (ptr && newSize >= REMAP_MIN_SIZE) ?
+        AllocChunkBlock(newSize, IsDirectSize(newSize)) : c_malloc(size);
     if (LIKELY(ptr && newPtr))
     {
         memcpy(newPtr, ptr, blockSize);
@@ -117,8 +193,11 @@ size_t c_malloc_usable_size(void* ptr) noexcept
         return 0;
 
     PageInfo info = GetPageInfoForPtr((char*)ptr);
-    ASSERT(info.size > 0);
-    return size_t(info.size);
+    ASSERT(info.GetSize() > 0);
+    if (info.IsSlab())
+        return SlabUsableSize(info);
+
+    return size_t(info.GetSize());
 }
 
 extern "C"
@@ -126,10 +205,42 @@ int c_posix_memalign(void** memptr, size_t alignment, size_t size) noexcept
 {
     LOG_DEBUG();
 
-    // @todo: accept arbitrary alignment
-    // right now, we're relying on the fact that all allocations start
-    // at the beginning of pages 
-    ASSERT(alignment <= PAGE);
+    // alignment must be a power of 2 multiple of sizeof(void*)
+    if (UNLIKELY((alignment & (alignment - 1)) != 0 ||
+            alignment < sizeof(void*)))
+        return EINVAL;
+
+    // all blocks are page aligned, larger alignments need
+    //  an aligned sub-block to be carved
+    if (alignment > PAGE)
+    {
+        // ensure malloc is initialized
+        if (UNLIKELY(!MallocInit))
+            InitMalloc();
+
+        // page rounding may wrap around
+        size_t blockSize = PAGE_CEILING(std::max(size, PAGE));
+        if (UNLIKELY(blockSize < size))
+            return ENOMEM;
+
+        // chunks are huge page aligned
+        char* ptr = (alignment <= HUGEPAGE && IsDirectSize(blockSize)) ?
+            AllocChunkBlock(blockSize, true) :
+            AllocBlockAligned(blockSize, alignment);
+        if (!ptr)
+            return ENOMEM;
+
+        LOG_DEBUG("provided ptr: %p", ptr);
+        *memptr = ptr;
+        return 0;
+    }
+
+    // power of 2 size classes are aligned to their size
+    if (alignment > SLAB_MIN_ALIGN && size <= SLAB_MAX_SIZE)
+    {
+        size = std::max(size, alignment);
+        size = (size_t)1 << (64 - __builtin_clzl(size - 1));
+    }
 
     char* ptr = (char*)c_malloc(size);
     if (!ptr)
@@ -147,7 +258,10 @@ void* c_aligned_alloc(size_t alignment, size_t size) noexcept
     void* ptr = nullptr;
     int ret = c_posix_memalign(&ptr, alignment, size);
     if (ret)
+    {
+        errno = ret;
         return nullptr;
+    }
 
     return ptr;
 }
@@ -182,9 +296,203 @@ void c_free(void* ptr) noexcept
         return;
 
     PageInfo info = GetPageInfoForPtr((char*)ptr);
-    ASSERT(info.size > 0);
+    ASSERT(info.GetSize() > 0);
+    if (info.IsSlab())
+    {
+        SlabFree(info, ptr);
+        return;
+    }
+
+    TKey key(info.GetSize(), (char*)ptr);
+    TCacheFree(key);
+}
+
+// blocks larger than slab objects are exactly PAGE_CEILING(size) bytes,
+//  where size is the allocation size, so page map lookup can be skipped
+static inline void FreeSizedBlock(void* ptr, size_t blockSize)
+{
+    // sanity check, provided size must match page map
+    ASSERT(!GetPageInfoForPtr((char*)ptr).IsSlab());
+    ASSERT(GetPageInfoForPtr((char*)ptr).GetSize() == (int64_t)blockSize);
+
+    TKey key(blockSize, (char*)ptr);
+    TCacheFree(key);
+}
+
+extern "C"
+void c_free_sized(void* ptr, size_t size) noexcept
+{
+    LOG_DEBUG("ptr: %p, size: %lu", ptr, size);
+    if (UNLIKELY(!ptr))
+        return;
+
+    // small sizes may be slab objects or blocks (e.g shrunk by realloc)
+    if (size <= SLAB_MAX_SIZE)
+    {
+        c_free(ptr);
+        return;
+    }
+
+    FreeSizedBlock(ptr, PAGE_CEILING(size));
+}
+
+extern "C"
+void c_free_aligned_sized(void* ptr, size_t alignment, size_t size) noexcept
+{
+    LOG_DEBUG("ptr: %p, alignment: %lu, size: %lu", ptr, alignment, size);
+    if (UNLIKELY(!ptr))
+        return;
+
+    // see c_posix_memalign, alignments larger than a page are always blocks
+    if (alignment > PAGE)
+    {
+        FreeSizedBlock(ptr, PAGE_CEILING(std::max(size, PAGE)));
+        return;
+    }
 
-    TKey key(info.size, (char*)ptr);
-    FreeBlock(key);
+    c_free_sized(ptr, size);
 }
 
+// c++ allocation operators
+// replaced so that sized and aligned deallocation use the fast paths above
+static void* OperatorNew(size_t size, size_t alignment, bool nothrow)
+{
+    while (true)
+    {
+        void* ptr = nullptr;
+        if (alignment <= SLAB_MIN_ALIGN)
+            ptr = c_malloc(size);
+        else if (c_posix_memalign(&ptr, std::max(alignment, sizeof(void*)), size))
+            ptr = nullptr;
+
+        if (LIKELY(ptr != nullptr))
+            return ptr;
+
+        // out of memory, new handler may release some memory
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            if (nothrow)
+                return nullptr;
+
+            throw std::bad_alloc();
+        }
+
+        if (!nothrow)
+        {
+            handler();
+            continue;
+        }
+
+        try
+        {
+            handler();
+        }
+        catch (...)
+        {
+            return nullptr;
+        }
+    }
+}
+
+void* operator new(size_t size)
+{
+    return OperatorNew(size, 0, false);
+}
+
+void* operator new[](size_t size)
+{
+    return OperatorNew(size, 0, false);
+}
+
+void* operator new(size_t size, std::nothrow_t const&) noexcept
+{
+    return OperatorNew(size, 0, true);
+}
+
+void* operator new[](size_t size, std::nothrow_t const&) noexcept
+{
+    return OperatorNew(size, 0, true);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return OperatorNew(size, (size_t)alignment, false);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return OperatorNew(size, (size_t)alignment, false);
+}
+
+void* operator new(size_t size, std::align_val_t alignment,
+        std::nothrow_t const&) noexcept
+{
+    return OperatorNew(size, (size_t)alignment, true);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment,
+        std::nothrow_t const&) noexcept
+{
+    return OperatorNew(size, (size_t)alignment, true);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    c_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    c_free(ptr);
+}
+
+void operator delete(void* ptr, std::nothrow_t const&) noexcept
+{
+    c_free(ptr);
+}
+
+void operator delete[](void* ptr, std::nothrow_t const&) noexcept
+{
+    c_free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+    c_free_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+    c_free_sized(ptr, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    c_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    c_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, std::nothrow_t const&) noexcept
+{
+    c_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, std::nothrow_t const&) noexcept
+{
+    c_free(ptr);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t alignment) noexcept
+{
+    c_free_aligned_sized(ptr, (size_t)alignment, size);
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t alignment) noexcept
+{
+    c_free_aligned_sized(ptr, (size_t)alignment, size);
+}
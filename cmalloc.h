@@ -13,6 +13,8 @@
 
 #define c_malloc malloc
 #define c_free free
+#define c_free_sized free_sized
+#define c_free_aligned_sized free_aligned_sized
 #define c_calloc calloc
 #define c_realloc realloc
 #define c_malloc_usable_size malloc_usable_size
@@ -39,6 +41,13 @@ extern "C"
     void c_free(void* ptr) noexcept
         CMALLOC_EXPORT CMALLOC_NOTHROW
         CMALLOC_CACHE_ALIGNED_FN;
+    // sized deallocation, size must be the size given on allocation
+    void c_free_sized(void* ptr, size_t size) noexcept
+        CMALLOC_EXPORT CMALLOC_NOTHROW
+        CMALLOC_CACHE_ALIGNED_FN;
+    void c_free_aligned_sized(void* ptr, size_t alignment, size_t size) noexcept
+        CMALLOC_EXPORT CMALLOC_NOTHROW
+        CMALLOC_CACHE_ALIGNED_FN;
     void* c_calloc(size_t n, size_t size) noexcept
         CMALLOC_EXPORT CMALLOC_NOTHROW CMALLOC_ALLOC_SIZE2(1, 2)
         CMALLOC_CACHE_ALIGNED_FN;
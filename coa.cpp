@@ -3,30 +3,38 @@
  * Licenced under the MIT licence. See COPYING file in the project root for details.
  */
 
+#include <cstring> // for memcpy
+#include <algorithm> // for max()
+
 #include "coa.h"
 
 #include "internal.h"
+#include "tcache.h"
 #include "log.h"
 
-void coa_init(size_t pages /*= 0*/)
+void coa_init(size_t pages /*= 0*/, size_t hugetlbPage /*= 0*/)
 {
-    LOG_DEBUG();
+    LOG_DEBUG("pages: %lu, hugetlbPage: %lu", pages, hugetlbPage);
 
     // init page map
     sPageMap.Init();
-    // init block tree
-    sTree = LFBSTree();
+    // init block trees
+    InitArenas();
 
     if (pages > 0)
-        ReserveBlockFromOS(pages);
+        ReserveBlockFromOS(pages, hugetlbPage);
 }
 
 void* coa_alloc(size_t size)
 {
     LOG_DEBUG("size: %lu", size);
 
+    // page rounding may wrap around
+    if (UNLIKELY(size > SIZE_MAX - PAGE))
+        return nullptr;
+
     size_t pages = PAGE_CEILING(size);
-    char* ptr = AllocBlock(pages);
+    char* ptr = TCacheAlloc(pages);
 
     LOG_DEBUG("ptr: %p", ptr);
     return (void*)ptr;
@@ -37,7 +45,29 @@ void* coa_alloc_pages(size_t pages)
     LOG_DEBUG("pages: %lu", pages);
 
     size_t size = pages * PAGE;
-    char* ptr = AllocBlock(size);
+    char* ptr = TCacheAlloc(size);
+
+    LOG_DEBUG("ptr: %p", ptr);
+    return (void*)ptr;
+}
+
+void* coa_alloc_aligned(size_t size, size_t align)
+{
+    LOG_DEBUG("size: %lu, align: %lu", size, align);
+    ASSERT((align & (align - 1)) == 0);
+
+    // all blocks are page aligned
+    if (align <= PAGE)
+        return coa_alloc(size);
+
+    // page rounding may wrap around
+    size_t blockSize = PAGE_CEILING(std::max(size, PAGE));
+    if (UNLIKELY(blockSize < size))
+        return nullptr;
+
+    // chunks are huge page aligned
+    char* ptr = (align <= HUGEPAGE && IsDirectSize(blockSize)) ?
+        AllocChunkBlock(blockSize, true) : AllocBlockAligned(blockSize, align);
 
     LOG_DEBUG("ptr: %p", ptr);
     return (void*)ptr;
@@ -50,10 +80,43 @@ void coa_free(void* ptr)
         return;
 
     PageInfo info = GetPageInfoForPtr((char*)ptr);
-    ASSERT(info.size > 0);
+    ASSERT(info.GetSize() > 0);
 
-    TKey key(info.size, (char*)ptr);
-    FreeBlock(key);
+    TKey key(info.GetSize(), (char*)ptr);
+    TCacheFree(key);
+}
+
+void coa_free_sized(void* ptr, size_t size)
+{
+    LOG_DEBUG("ptr: %p, size: %lu", ptr, size);
+    if (UNLIKELY(!ptr))
+        return;
+
+    // blocks are exactly PAGE_CEILING(size) bytes
+    // sanity check, provided size must match page map
+    size_t blockSize = PAGE_CEILING(std::max(size, (size_t)1));
+    ASSERT(GetPageInfoForPtr((char*)ptr).GetSize() == (int64_t)blockSize);
+
+    TKey key(blockSize, (char*)ptr);
+    TCacheFree(key);
+}
+
+size_t coa_alloc_batch(size_t size, size_t n, void** ptrs)
+{
+    LOG_DEBUG("size: %lu, n: %lu", size, n);
+
+    // page rounding may wrap around
+    size_t blockSize = PAGE_CEILING(std::max(size, (size_t)1));
+    if (UNLIKELY(blockSize < size))
+        return 0;
+
+    return AllocBlockBatch(blockSize, n, (char**)ptrs);
+}
+
+void coa_free_batch(void** ptrs, size_t n)
+{
+    LOG_DEBUG("n: %lu", n);
+    FreeBlockBatch((char**)ptrs, n);
 }
 
 void coa_free_r(void* ptr)
@@ -63,8 +126,103 @@ void coa_free_r(void* ptr)
         return;
 
     PageInfo info = GetPageInfoForPtr((char*)ptr);
-    ASSERT(info.size > 0);
+    ASSERT(info.GetSize() > 0);
 
-    TKey key(info.size, (char*)ptr);
+    TKey key(info.GetSize(), (char*)ptr);
     FreeBlock(key, true); // do recursive coalescing
 }
+
+bool coa_resize(void* ptr, size_t size)
+{
+    LOG_DEBUG("ptr: %p, size: %lu", ptr, size);
+    ASSERT(ptr);
+
+    PageInfo info = GetPageInfoForPtr((char*)ptr);
+    ASSERT(info.GetSize() > 0);
+
+    // page rounding may wrap around
+    if (UNLIKELY(size > SIZE_MAX - PAGE))
+        return false;
+
+    TKey key(info.GetSize(), (char*)ptr);
+    return ResizeBlock(key, PAGE_CEILING(std::max(size, (size_t)1)));
+}
+
+void* coa_realloc(void* ptr, size_t size)
+{
+    LOG_DEBUG("ptr: %p, size: %lu", ptr, size);
+    if (UNLIKELY(ptr == nullptr))
+        return coa_alloc(size);
+
+    if (UNLIKELY(size == 0))
+    {
+        coa_free(ptr);
+        return nullptr;
+    }
+
+    if (coa_resize(ptr, size))
+        return ptr;
+
+    void* newPtr = coa_alloc(size);
+    if (LIKELY(newPtr != nullptr))
+    {
+        // resize only fails when growing
+        size_t oldSize = GetPageInfoForPtr((char*)ptr).GetSize();
+        memcpy(newPtr, ptr, oldSize);
+        coa_free(ptr);
+    }
+
+    return newPtr;
+}
+
+void coa_thread_flush()
+{
+    LOG_DEBUG();
+    TCacheFlush();
+}
+
+void coa_set_thread_cache_budget(size_t bytes)
+{
+    LOG_DEBUG("bytes: %lu", bytes);
+    sTCacheBudget.store(bytes);
+}
+
+void coa_set_lazy_coalescing(bool enable)
+{
+    LOG_DEBUG("enable: %d", enable);
+    sLazyCoalescing.store(enable);
+}
+
+void coa_purge()
+{
+    LOG_DEBUG();
+    PurgeBlocks(true);
+}
+
+void coa_set_purge_decay(int64_t ms)
+{
+    LOG_DEBUG("ms: %ld", ms);
+    sPurgeDecayMs.store(ms);
+}
+
+void coa_set_direct_threshold(size_t bytes)
+{
+    LOG_DEBUG("bytes: %lu", bytes);
+    sDirectAdaptive.store(false);
+    sDirectMinSize.store(bytes > 0 ? bytes : SIZE_MAX);
+}
+
+size_t coa_retired_nodes()
+{
+    return BlockIndex::GetNumRetiredNodes();
+}
+
+size_t coa_regular_bytes()
+{
+    return sRegularChunkBytes.load();
+}
+
+size_t coa_hugetlb_bytes()
+{
+    return sHugeTLBChunkBytes.load();
+}
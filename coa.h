@@ -8,18 +8,83 @@
 
 #include "defines.h"
 
+// hugetlb page sizes, for coa_init
+#define COA_HUGETLB_2M ((size_t)1 << 21)
+#define COA_HUGETLB_1G ((size_t)1 << 30)
+
 // initialize coalescing mechanism
 // constructs internal structures, must be called before any alloc/free
 // if pages > 0, immediately allocates that many pages from OS for storage
-void coa_init(size_t pages = 0);
+// if hugetlbPage > 0, storage is backed by hugetlb pages of that size
+//  (COA_HUGETLB_2M or COA_HUGETLB_1G) when the hugetlb pool allows it,
+//  falling back to regular pages otherwise
+void coa_init(size_t pages = 0, size_t hugetlbPage = 0);
 
 // allocate a block with the requested size, in bytes
 void* coa_alloc(size_t size);
 // allocate a block with the requested size, in pages
 void* coa_alloc_pages(size_t pages);
+// allocate a block with the requested size, in bytes, whose address
+//  is a multiple of align, which must be a power of 2
+void* coa_alloc_aligned(size_t size, size_t align);
 
 // deallocate a previously allocated block
 void coa_free(void* ptr);
 void coa_free_r(void* ptr); // perform recursive coalescing
+// size must be the size given on allocation, skips block size lookup
+void coa_free_sized(void* ptr, size_t size);
+
+// batch operations
+// allocate up to n blocks with the requested size, in bytes, into ptrs
+// blocks are carved from a single larger block when possible
+// returns number of blocks allocated
+size_t coa_alloc_batch(size_t size, size_t n, void** ptrs);
+// deallocate n previously allocated blocks
+// adjacent blocks are coalesced together first, ptrs is reordered
+void coa_free_batch(void** ptrs, size_t n);
+
+// resize a block in place
+// when growing, absorbs the free block that follows it
+// when shrinking by at least a page, frees its tail
+// returns false if the block can't grow in place
+bool coa_resize(void* ptr, size_t size);
+// resize a block in place if possible, otherwise moves it to a new block
+// same semantics as realloc()
+void* coa_realloc(void* ptr, size_t size);
+
+// thread cache
+// coa_alloc/coa_free keep small blocks in a per-thread cache
+// return all blocks cached by calling thread, done automatically
+//  on thread exit if thread hooks are linked in
+void coa_thread_flush();
+// max bytes cached per thread, 0 disables caching
+void coa_set_thread_cache_budget(size_t bytes);
+
+// lazy coalescing
+// if enabled, freed blocks are only coalesced when storage runs out, or when
+//  too many blocks are waiting, which lowers free latency but may increase
+//  fragmentation
+void coa_set_lazy_coalescing(bool enable);
+
+// purging
+// free blocks are returned to the OS after a decay time
+// purge all blocks freed by calling thread, regardless of decay time
+void coa_purge();
+// set decay time in milliseconds, 0 purges immediately, < 0 disables
+void coa_set_purge_decay(int64_t ms);
+
+// direct blocks
+// blocks of at least the direct threshold get their own mapping, and are
+//  unmapped as soon as they are freed
+// the threshold adapts to the sizes freed, until it's set explicitly
+// set threshold in bytes, 0 disables direct blocks
+void coa_set_direct_threshold(size_t bytes);
+
+// statistics
+// number of internal tree nodes retired but not yet reused
+size_t coa_retired_nodes();
+// bytes currently mapped from the OS with regular and hugetlb pages
+size_t coa_regular_bytes();
+size_t coa_hugetlb_bytes();
 
 #endif // __COA_H
@@ -22,6 +22,7 @@
 
 #define CACHELINE_MASK  (CACHELINE - 1)
 #define PAGE_MASK       (PAGE - 1)
+#define HUGEPAGE_MASK   (HUGEPAGE - 1)
 
 // minimum alignment requirement all allocations must meet
 // "address returned by malloc will be suitably aligned to store any kind of variable"
@@ -36,6 +37,10 @@
 #define PAGE_CEILING(s) \
     (((s) + (PAGE - 1)) & ~(PAGE - 1))
 
+// return smallest huge page size multiple that is >= s
+#define HUGEPAGE_CEILING(s) \
+    (((s) + (HUGEPAGE - 1)) & ~(HUGEPAGE - 1))
+
 // https://stackoverflow.com/questions/109710/how-do-the-likely-and-unlikely-macros-in-the-linux-kernel-work-and-what-is-t
 #define LIKELY(x)       __builtin_expect((x), 1)
 #define UNLIKELY(x)     __builtin_expect((x), 0)
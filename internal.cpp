@@ -4,132 +4,380 @@
  */
 
 #include <cstring> // for memset/memcpy
-#include <algorithm> // for max()
+#include <algorithm> // for max(), sort()
+#include <time.h> // for clock_gettime()
+#include <sys/mman.h> // for madvise()
 
 #include "log.h" // for ASSERT
 #include "pages.h"
+#include "arena.h"
 
 #include "internal.h"
 
+// lock free stack of free blocks of the same size
+// blocks are tracked by tree nodes, which are never returned to the OS
+//  so popping a stale head never touches unmapped memory
+// nodes are linked through their left edge, and the head is tagged
+//  to prevent ABA issues
+struct BlockStackHead
+{
+    Node* node;
+    size_t tag;
+};
+
+struct BlockStack
+{
+    std::atomic<BlockStackHead> head;
+} CMALLOC_CACHE_ALIGNED;
+
+// one arena per numa node, see arena.h
+// blocks never move between arenas, as they never span more than one chunk
+struct Arena
+{
+    // block index
+    BlockIndex tree;
+    // exact-size free lists, indexed by number of pages
+    BlockStack stacks[BLOCK_STACK_MAX_PAGES + 1];
+    // larger blocks freed in lazy coalescing mode, of any size
+    BlockStack lazy;
+    // bytes in all free lists, which aren't coalesced
+    std::atomic<size_t> stackedBytes;
+};
+
+// free block waiting for decay
+// plain fields so it can be stored in thread-local storage
+struct PurgeEntry
+{
+    size_t size;
+    char* address;
+    int64_t time;
+};
+
 // global variables
-// block tree
-LFBSTree sTree;
+static Arena sArenas[ARENA_MAX];
+std::atomic<size_t> sRegularChunkBytes(0);
+std::atomic<size_t> sHugeTLBChunkBytes(0);
+std::atomic<int64_t> sPurgeDecayMs(PURGE_DECAY_MS);
+std::atomic<bool> sLazyCoalescing(LAZY_COALESCING);
+std::atomic<size_t> sDirectMinSize(DIRECT_MIN_SIZE);
+std::atomic<bool> sDirectAdaptive(DIRECT_ADAPTIVE);
+
+// thread-local variables
+// ring buffer of freed blocks, in free order
+static __thread PurgeEntry sPurgeQueue[PURGE_QUEUE_SIZE];
+static __thread size_t sPurgeHead = 0;
+static __thread size_t sPurgeTail = 0;
+static __thread size_t sNumPurgeEnqueues = 0;
+
+static inline BlockStack* GetBlockStack(Arena* arena, size_t size)
+{
+    size_t pages = size >> LG_PAGE;
+    if (pages > BLOCK_STACK_MAX_PAGES)
+        return nullptr;
+
+    return &arena->stacks[pages];
+}
+
+static void PushBlock(Arena* arena, BlockStack* stack, TKey key)
+{
+    arena->stackedBytes.fetch_add(key.size, std::memory_order_relaxed);
+
+    Node* node = AllocNode(key);
+    BlockStackHead oldHead = stack->head.load();
+    BlockStackHead newHead;
+    do
+    {
+        node->left.store(NodeChild(oldHead.node));
+        newHead.node = node;
+        newHead.tag = oldHead.tag + 1;
+    }
+    while (!stack->head.compare_exchange_weak(oldHead, newHead));
+}
+
+static char* PopBlock(Arena* arena, BlockStack* stack)
+{
+    BlockStackHead oldHead = stack->head.load();
+    BlockStackHead newHead;
+    do
+    {
+        if (oldHead.node == nullptr)
+            return nullptr;
+
+        // node may be concurrently popped and reused
+        // tag ensures CAS fails if that happens
+        newHead.node = oldHead.node->left.load().GetPtr();
+        newHead.tag = oldHead.tag + 1;
+    }
+    while (!stack->head.compare_exchange_weak(oldHead, newHead));
+
+    char* block = oldHead.node->key.address;
+    arena->stackedBytes.fetch_sub(oldHead.node->key.size,
+            std::memory_order_relaxed);
+    FreeNode(oldHead.node);
+    return block;
+}
+
+// detach all blocks from stack, returns list linked by left edge
+static Node* PopAllBlocks(BlockStack* stack)
+{
+    BlockStackHead oldHead = stack->head.load();
+    BlockStackHead newHead;
+    do
+    {
+        if (oldHead.node == nullptr)
+            return nullptr;
+
+        newHead.node = nullptr;
+        newHead.tag = oldHead.tag + 1;
+    }
+    while (!stack->head.compare_exchange_weak(oldHead, newHead));
+
+    return oldHead.node;
+}
+
+void SetPageInfoKeepChunk(char* ptr, PageInfo info)
+{
+    // only the block owner updates its pages, no need for CAS
+    PageInfo old = sPageMap.GetPageInfo(ptr);
+    sPageMap.SetPageInfo(ptr, PageInfo(info.size | (old.size & PI_CHUNK_FLAGS)));
+}
 
 // PageMap::UpdatePageInfo wrappers
-void SetBlock(TKey key)
+void SetBlock(TKey key, bool clean /*= false*/)
 {
     char* ptr = key.address;
     size_t size = key.size;
     // block must be cleared before setting
+    ASSERT(sPageMap.GetPageInfo(ptr).GetSize() == 0);
     // set block start
-    bool res = sPageMap.UpdatePageInfo(ptr, PageInfo(0), PageInfo(size));
-    (void)res; // suppress unused warning
-    ASSERT(res);
+    int64_t start = size | (clean ? PI_CLEAN_FLAG : 0);
+    SetPageInfoKeepChunk(ptr, PageInfo(start));
 
     // set block end (only if block isn't a single-page block)
     if (size == PAGE)
         return;
 
-    res = sPageMap.UpdatePageInfo(ptr + size - PAGE, PageInfo(0), PageInfo(-size));
-    (void)res; // suppress unused warning
-    ASSERT(res);
+    ASSERT(sPageMap.GetPageInfo(ptr + size - PAGE).GetSize() == 0);
+    SetPageInfoKeepChunk(ptr + size - PAGE, PageInfo(-size));
 }
 
-void ClearBlock(TKey key)
+bool ClearBlock(TKey key)
 {
     char* ptr = key.address;
     size_t size = key.size;
     // clear start of block
-    bool res = sPageMap.UpdatePageInfo(ptr, PageInfo(size), PageInfo(0));
-    (void)res; // suppress unused warning
-    ASSERT(res);
+    PageInfo info = sPageMap.GetPageInfo(ptr);
+    ASSERT(info.GetSize() == (int64_t)size);
+    SetPageInfoKeepChunk(ptr, PageInfo(0));
 
     // clear end of block (if block isn't a single-page block)
-    res = sPageMap.UpdatePageInfo(ptr + size - PAGE, PageInfo(-size), PageInfo(0));
+    if (size != PAGE)
+    {
+        ASSERT(sPageMap.GetPageInfo(ptr + size - PAGE).GetSize() == -(int64_t)size);
+        SetPageInfoKeepChunk(ptr + size - PAGE, PageInfo(0));
+    }
+
+    return info.IsClean();
 }
 
-// allocate block
-// if os = 0, using only internal storage
-// if os > 0, if a block cannot be found in internal storage, allocates
-//  a block with size max(os, size) from the OS
-char* AllocBlock(size_t size, size_t os /*= HUGEPAGE*/)
+// marks first and last page of a chunk obtained from the OS
+// hugetlb chunks are marked on every page, as any block in them
+//  must be recognized as such
+// direct chunks are marked on their first page
+static void SetChunk(TKey key, size_t arena, bool hugetlb = false,
+        bool direct = false)
 {
-    if (UNLIKELY(size == 0))
-        size = PAGE;
+    SetArenaForChunk(key.address, key.size, arena);
 
-    ASSERT((size & PAGE_MASK) == 0);
+    if (hugetlb)
+    {
+        for (size_t off = 0; off < key.size; off += PAGE)
+            sPageMap.SetPageInfo(key.address + off, PageInfo(PI_HUGETLB_FLAG));
 
-    TKey key(size);
-    if (!sTree.RemoveNext(key))
+        sHugeTLBChunkBytes.fetch_add(key.size);
+    }
+    else
+        sRegularChunkBytes.fetch_add(key.size);
+
+    char* last = key.address + key.size - PAGE;
+    PageInfo start = sPageMap.GetPageInfo(key.address);
+    int64_t flags = PI_CHUNK_START_FLAG | (direct ? PI_DIRECT_FLAG : 0);
+    sPageMap.SetPageInfo(key.address, PageInfo(start.size | flags));
+    PageInfo end = sPageMap.GetPageInfo(last);
+    sPageMap.SetPageInfo(last, PageInfo(end.size | PI_CHUNK_END_FLAG));
+}
+
+static inline int64_t GetTimeMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// block is no longer free, or was already purged, if it can't be removed
+static void PurgeBlock(TKey key)
+{
+    // queue entries may be stale, and an identical key may since have been
+    //  freed in a hugetlb chunk, which is never purged nor unmapped
+    // hugetlb pages keep their flag for as long as the chunk exists
+    if (sPageMap.GetPageInfo(key.address).IsHugeTLB())
+        return;
+
+    Arena* arena = &sArenas[GetArenaForPtr(key.address)];
+    if (!arena->tree.Remove(key))
+        return;
+
+    PageInfo start = sPageMap.GetPageInfo(key.address);
+    ASSERT(!start.IsHugeTLB());
+    PageInfo end = sPageMap.GetPageInfo(key.address + key.size - PAGE);
+    if (start.IsChunkStart() && end.IsChunkEnd())
     {
-        if (os == 0)
-            return nullptr;
+        // whole chunk is free, return it to the OS
+        // blocks never span more than one chunk
+        ClearBlock(key);
+        sPageMap.SetPageInfo(key.address, PageInfo(0));
+        sPageMap.SetPageInfo(key.address + key.size - PAGE, PageInfo(0));
+        PageFree(key.address, key.size);
+        sRegularChunkBytes.fetch_sub(key.size);
+        return;
+    }
 
-        // no available blocks
-        // alloc a large block and carve from it
-        size_t blockSize = std::max(size, os);
-        char* block = (char*)PageAlloc(blockSize);
-        if (UNLIKELY(block == nullptr))
-            return nullptr;
+    if (!start.IsClean())
+    {
+        char* begin = key.address;
+        char* end = key.address + key.size;
+#if PAGES_THP
+        // purging part of a huge page splits it, only purge whole huge pages
+        begin = ALIGN_ADDR(begin, HUGEPAGE);
+        end = (char*)((size_t)end & ~HUGEPAGE_MASK);
+#endif
+        if (begin < end)
+            madvise(begin, end - begin, PURGE_ADVICE);
+
+        // block is only clean if it was entirely purged
+        if (begin == key.address && end == key.address + key.size)
+            SetPageInfoKeepChunk(key.address, PageInfo(start.GetSize() | PI_CLEAN_FLAG));
+    }
 
-        key = TKey(blockSize, block);
-        // update page map
-        SetBlock(key);
+    bool res = arena->tree.Insert(key);
+    (void)res; // suppress unused warning
+    ASSERT(res);
+}
+
+// track a dirty block inserted in the tree
+static void PurgeEnqueue(TKey key)
+{
+    int64_t decay = sPurgeDecayMs.load(std::memory_order_relaxed);
+    if (decay < 0)
+        return;
+
+    if (decay == 0)
+    {
+        PurgeBlock(key);
+        return;
     }
 
-    // obtained a block, check size and split if needed
-    ASSERT(key.size >= size);
+    // queue full, purge oldest block early
+    if (sPurgeTail - sPurgeHead == PURGE_QUEUE_SIZE)
+    {
+        PurgeEntry& oldest = sPurgeQueue[sPurgeHead++ % PURGE_QUEUE_SIZE];
+        PurgeBlock(TKey(oldest.size, oldest.address));
+    }
 
-    // not exact match, need to split block
-    if (key.size > size)
+    PurgeEntry& entry = sPurgeQueue[sPurgeTail++ % PURGE_QUEUE_SIZE];
+    entry.size = key.size;
+    entry.address = key.address;
+    entry.time = GetTimeMs();
+
+    if (++sNumPurgeEnqueues % PURGE_CHECK_FREQ == 0)
+        PurgeBlocks();
+}
+
+void PurgeBlocks(bool force /*= false*/)
+{
+    int64_t decay = sPurgeDecayMs.load(std::memory_order_relaxed);
+    int64_t now = GetTimeMs();
+    while (sPurgeHead != sPurgeTail)
     {
-        // clear page map info for block
-        ClearBlock(key);
-        // update info of returning block
-        SetBlock(TKey(size, key.address));
-        // update info of leftover block
-        size_t loSize = key.size - size;
-        char* loBlock = key.address + size;
-        TKey k(loSize, loBlock);
-        SetBlock(k);
-        // then insert leftover block in tree
-        bool res = sTree.Insert(k);
-        (void)res; // suppress warning
-        // insert can't fail, we own the block
-        ASSERT(res);
+        PurgeEntry& entry = sPurgeQueue[sPurgeHead % PURGE_QUEUE_SIZE];
+        if (!force && (decay < 0 || entry.time + decay > now))
+            break;
+
+        sPurgeHead++;
+        PurgeBlock(TKey(entry.size, entry.address));
     }
+}
 
-    // return block
-    ASSERT(((size_t)key.address & PAGE_MASK) == 0);
-    return key.address;
+// splitting a free block touches all huge pages the returned block overlaps
+// returns true if the returned block should be carved from the end of
+//  the free block, which happens when it fits in a huge page that is
+//  already partially in use at the end, but not at the start
+static inline bool CarveFromEnd(TKey key, size_t size)
+{
+#if PAGES_THP
+    if (size >= HUGEPAGE)
+        return false;
+
+    size_t start = (size_t)key.address;
+    size_t end = start + key.size;
+    size_t frontRoom = (HUGEPAGE - (start & HUGEPAGE_MASK)) & HUGEPAGE_MASK;
+    if (frontRoom >= size)
+        return false;
+
+    size_t backRoom = end & HUGEPAGE_MASK;
+    return backRoom >= size;
+#else
+    (void)key; // suppress unused warning
+    (void)size;
+    return false;
+#endif
 }
 
-void FreeBlock(TKey key, bool recursiveCoa /*= false*/)
+// insert a free block in tree
+static void InsertBlock(Arena* arena, TKey key, bool clean)
 {
-    ASSERT((key.size & PAGE_MASK) == 0);
-    ASSERT(((size_t)key.address & PAGE_MASK) == 0);
+    bool res = arena->tree.Insert(key);
+    (void)res; // suppress unused warning
+    // insert can't fail, we own the block
+    ASSERT(res);
+
+    // hugetlb pages are reserved by the user, never purge them
+    if (!clean && !sPageMap.GetPageInfo(key.address).IsHugeTLB())
+        PurgeEnqueue(key);
+}
 
+// coalesce a free block with its free neighbours, and insert it in the tree
+// if useStack = true, small blocks without free neighbours go to exact-size
+//  free lists instead
+static void CoalesceBlock(Arena* arena, TKey key, bool recursiveCoa, bool useStack)
+{
     // update page map before coalescing
     // @todo: optimize, this is useless if we don't coalesce at all
+    //  (lazy coalescing skips it)
     ClearBlock(key);
 
+    bool coalesced = false;
     // try backwards coalescing
-    while (true)
+    // blocks never span more than one chunk
+    while (!sPageMap.GetPageInfo(key.address).IsChunkStart())
     {
         char* prevPage = (char*)(key.address - PAGE);
         PageInfo info = GetPageInfoForPtr(prevPage);
 
         // fetch info for previous block
-        if (info.size == 0)
+        if (info.GetSize() == 0)
             break; // no info for previous block
 
-        TKey k(-info.size, (char*)(key.address + info.size));
-        if (info.size == PAGE) // single-page block
+        if (info.IsSlab())
+            break; // previous block is in use by a slab
+
+        TKey k(-info.GetSize(), (char*)(key.address + info.GetSize()));
+        if (info.GetSize() == (int64_t)PAGE) // single-page block
             k = TKey(PAGE, (char*)(key.address - PAGE));
 
         // try to acquire previous block
         // can fail if: block not free, or does not exist
-        if (!sTree.Remove(k))
+        if (!arena->tree.Remove(k))
             break;
 
         // backward coalescing successful
@@ -138,25 +386,26 @@ void FreeBlock(TKey key, bool recursiveCoa /*= false*/)
         // update block size
         key.size += k.size;
         key.address = k.address;
+        coalesced = true;
         if (!recursiveCoa)
             break;
     }
 
     // try forward coalescing
-    while (true)
+    while (!sPageMap.GetPageInfo(key.address + key.size - PAGE).IsChunkEnd())
     {
         char* nextBlock = (char*)(key.address + key.size);
         PageInfo info = sPageMap.GetPageInfo(nextBlock);
 
         // fetch info for next block
-        if (info.size <= 0)
+        if (info.GetSize() <= 0 || info.IsSlab())
             break;
 
-        TKey k((size_t)info.size, nextBlock);
+        TKey k((size_t)info.GetSize(), nextBlock);
 
         // try to acquire next block
         // can fail if: block not free, or does not exist
-        if (!sTree.Remove(k))
+        if (!arena->tree.Remove(k))
             break;
 
         // forward coalescing successful
@@ -164,31 +413,511 @@ void FreeBlock(TKey key, bool recursiveCoa /*= false*/)
         ClearBlock(k);
         // update block size
         key.size += k.size;
+        coalesced = true;
         if (!recursiveCoa)
             break;
     }
 
     // update page map after coalescing
     SetBlock(key);
+
+    // small blocks without free neighbours go to exact-size free lists
+    BlockStack* stack = (coalesced || !useStack) ?
+        nullptr : GetBlockStack(arena, key.size);
+    if (stack)
+    {
+        PushBlock(arena, stack, key);
+        return;
+    }
+
     // and add to tree as a free block
-    bool res = sTree.Insert(key);
-    (void)res; // suppress unused warning
-    ASSERT(res);
+    InsertBlock(arena, key, false);
+}
+
+// blocks in exact-size free lists are never coalesced, and can fragment
+//  the arena over time
+// moves them to the tree, coalescing them with each other and with
+//  their free neighbours
+// returns true if any block was moved
+static bool DrainBlockStacks(Arena* arena)
+{
+    bool drained = false;
+    for (size_t pages = 1; pages <= BLOCK_STACK_MAX_PAGES + 1; ++pages)
+    {
+        BlockStack* stack = (pages <= BLOCK_STACK_MAX_PAGES) ?
+            &arena->stacks[pages] : &arena->lazy;
+        Node* node = PopAllBlocks(stack);
+        while (node)
+        {
+            Node* next = node->left.load().GetPtr();
+            TKey key = node->key;
+            FreeNode(node);
+            arena->stackedBytes.fetch_sub(key.size, std::memory_order_relaxed);
+            CoalesceBlock(arena, key, true, false);
+            node = next;
+            drained = true;
+        }
+    }
+
+    return drained;
+}
+
+void InitArenas()
+{
+    ArenaInit();
+    for (size_t i = 0; i < sNumArenas; ++i)
+        new (&sArenas[i].tree) BlockIndex();
+}
+
+// allocate block
+// if os = 0, using only internal storage
+// if os > 0, if a block cannot be found in internal storage, allocates
+//  a block with size max(os, size) from the OS
+char* AllocBlock(size_t size, size_t os /*= HUGEPAGE*/,
+        bool* zeroed /*= nullptr*/)
+{
+    if (UNLIKELY(size == 0))
+        size = PAGE;
+
+    ASSERT((size & PAGE_MASK) == 0);
+
+    // blocks come from the arena of the calling thread's node
+    size_t arenaIdx = GetCurrentArena();
+    Arena* arena = &sArenas[arenaIdx];
+
+    // try exact-size free lists first
+    // blocks there have up to date page map info
+    BlockStack* stack = GetBlockStack(arena, size);
+    if (stack)
+    {
+        char* block = PopBlock(arena, stack);
+        if (block)
+        {
+            if (zeroed)
+                *zeroed = false;
+
+            return block;
+        }
+    }
+
+    // smallest key that fits size, according to tree's fit policy
+    TKey const fitKey = BlockIndex::FitType::FitKey(size);
+    TKey key = fitKey;
+    bool found = arena->tree.RemoveNext(key);
+    if (!found && DrainBlockStacks(arena))
+    {
+        key = fitKey;
+        found = arena->tree.RemoveNext(key);
+    }
+
+    // if using only internal storage, a remote block is better than none
+    for (size_t i = 1; !found && os == 0 && i < sNumArenas; ++i)
+    {
+        arena = &sArenas[(arenaIdx + i) % sNumArenas];
+        key = fitKey;
+        found = arena->tree.RemoveNext(key);
+    }
+
+    if (!found)
+    {
+        if (os == 0)
+            return nullptr;
+
+        // no available blocks
+        // alloc a large block and carve from it
+        size_t blockSize = std::max(size, os);
+#if PAGES_THP
+        // chunk end is also huge page aligned
+        blockSize = HUGEPAGE_CEILING(blockSize);
+#endif
+        char* block = (char*)PageAllocChunk(blockSize);
+        if (UNLIKELY(block == nullptr))
+            return nullptr;
+
+        key = TKey(blockSize, block);
+        // update page map
+        // pages given by the OS aren't backed by memory yet
+        SetChunk(key, arenaIdx);
+        SetBlock(key, true);
+    }
+
+    // obtained a block, check size and split if needed
+    ASSERT(key.size >= size);
+
+    // clean blocks were fresh from the OS or purged, and are zero-filled
+    bool clean;
+    // not exact match, need to split block
+    if (key.size > size)
+    {
+        // clear page map info for block
+        clean = ClearBlock(key);
+        // returning block is carved from the start of block, unless
+        //  that would touch an untouched huge page
+        size_t loSize = key.size - size;
+        char* block = key.address;
+        char* loBlock = key.address + size;
+        if (CarveFromEnd(key, size))
+        {
+            block = key.address + loSize;
+            loBlock = key.address;
+        }
+
+        // update info of returning block
+        key = TKey(size, block);
+        SetBlock(key);
+        // update info of leftover block
+        TKey k(loSize, loBlock);
+        SetBlock(k, clean);
+        // then insert leftover block in tree
+        InsertBlock(arena, k, clean);
+    }
+    else
+    {
+        // returning block is going to be written to
+        PageInfo info = sPageMap.GetPageInfo(key.address);
+        clean = info.IsClean();
+        if (clean)
+            SetPageInfoKeepChunk(key.address, PageInfo(info.GetSize()));
+    }
+
+    if (zeroed)
+        *zeroed = clean;
+
+    // return block
+    ASSERT(((size_t)key.address & PAGE_MASK) == 0);
+    return key.address;
 }
 
-void ReserveBlockFromOS(size_t pages)
+// direct block is a whole chunk, nothing to coalesce with
+static void FreeDirectBlock(TKey key)
 {
-    size_t const blockSize = pages * PAGE;
-    char* block = (char*)PageAlloc(blockSize);
+#if DIRECT_ADAPTIVE
+    // size is being freed, later blocks of this size are reused instead
+    size_t minSize = sDirectMinSize.load(std::memory_order_relaxed);
+    while (sDirectAdaptive.load(std::memory_order_relaxed) &&
+            key.size >= minSize && key.size < DIRECT_MAX_SIZE &&
+            !sDirectMinSize.compare_exchange_weak(minSize, key.size + PAGE))
+        ;
+#endif
+
+    // range may be reused by other threads as soon as it's unmapped
+    //  so its page map info must be cleared first
+    sPageMap.SetPageInfo(key.address, PageInfo(0));
+    sPageMap.SetPageInfo(key.address + key.size - PAGE, PageInfo(0));
+    PageFree(key.address, key.size);
+    sRegularChunkBytes.fetch_sub(key.size);
+}
+
+void FreeBlock(TKey key, bool recursiveCoa /*= false*/)
+{
+    ASSERT((key.size & PAGE_MASK) == 0);
+    ASSERT(((size_t)key.address & PAGE_MASK) == 0);
+
+    if (UNLIKELY(sPageMap.GetPageInfo(key.address).IsDirect()))
+    {
+        FreeDirectBlock(key);
+        return;
+    }
+
+    // coalesced blocks belong to the same chunk, and so to the same arena
+    Arena* arena = &sArenas[GetArenaForPtr(key.address)];
+    if (!sLazyCoalescing.load(std::memory_order_relaxed))
+    {
+        CoalesceBlock(arena, key, recursiveCoa, true);
+        return;
+    }
+
+    // lazy coalescing, block is coalesced only when needed
+    // page map info is kept as is
+    BlockStack* stack = GetBlockStack(arena, key.size);
+    PushBlock(arena, stack ? stack : &arena->lazy, key);
+
+    // too many uncoalesced blocks, fragmentation is getting high
+    if (UNLIKELY(arena->stackedBytes.load(std::memory_order_relaxed) >
+            LAZY_MAX_BYTES))
+        DrainBlockStacks(arena);
+}
+
+void ReserveBlockFromOS(size_t pages, size_t hugetlbSize /*= 0*/)
+{
+    size_t blockSize = pages * PAGE;
+    char* block = nullptr;
+    bool hugetlb = false;
+    if (hugetlbSize > 0)
+    {
+        size_t hugeBlockSize = (blockSize + hugetlbSize - 1) & ~(hugetlbSize - 1);
+        block = (char*)PageAllocHugeTLB(hugeBlockSize, hugetlbSize);
+        if (block)
+        {
+            blockSize = hugeBlockSize;
+            hugetlb = true;
+        }
+    }
+
+    // no hugetlb pages requested or available
+    if (!block)
+        block = (char*)PageAllocChunk(blockSize);
+
     if (UNLIKELY(block == nullptr))
         return;
 
+    // reserved block goes to the arena of the calling thread's node
+    size_t arenaIdx = GetCurrentArena();
     TKey key = TKey(blockSize, block);
     // update page map
+    SetChunk(key, arenaIdx, hugetlb);
+    SetBlock(key, true);
+    InsertBlock(&sArenas[arenaIdx], key, true);
+}
+
+char* AllocBlockAligned(size_t size, size_t align)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+    ASSERT((align & (align - 1)) == 0);
+
+    // all blocks are page aligned
+    if (align <= PAGE)
+        return AllocBlock(size);
+
+    // a block this large necessarily contains an aligned sub-block
+    if (UNLIKELY(size > SIZE_MAX - (align - PAGE)))
+        return nullptr;
+
+    size_t blockSize = size + align - PAGE;
+    char* block = AllocBlock(blockSize);
+    if (UNLIKELY(block == nullptr))
+        return nullptr;
+
+    char* aligned = ALIGN_ADDR(block, align);
+    size_t leadSize = aligned - block;
+    size_t trailSize = blockSize - leadSize - size;
+    if (leadSize == 0 && trailSize == 0)
+        return block;
+
+    // carve aligned sub-block, and free the leading and trailing remainders
+    ClearBlock(TKey(blockSize, block));
+    SetBlock(TKey(size, aligned));
+    if (leadSize > 0)
+    {
+        TKey lead(leadSize, block);
+        SetBlock(lead);
+        FreeBlock(lead);
+    }
+
+    if (trailSize > 0)
+    {
+        TKey trail(trailSize, aligned + size);
+        SetBlock(trail);
+        FreeBlock(trail);
+    }
+
+    return aligned;
+}
+
+size_t AllocBlockBatch(size_t size, size_t n, char** blocks)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+
+    // whole batch must fit in a single block size
+    size_t total = n * size;
+    if (UNLIKELY(size == 0 || (n > 0 && total / n != size)))
+        return 0;
+
+    size_t count = 0;
+    size_t batch = n;
+    while (count < n && batch > 0)
+    {
+        batch = std::min(batch, n - count);
+        // single block for the whole batch, split in one pass
+        char* block = AllocBlock(batch * size);
+        if (UNLIKELY(block == nullptr))
+        {
+            batch /= 2;
+            continue;
+        }
+
+        if (batch > 1)
+        {
+            ClearBlock(TKey(batch * size, block));
+            for (size_t i = 0; i < batch; ++i)
+                SetBlock(TKey(size, block + i * size));
+        }
+
+        for (size_t i = 0; i < batch; ++i)
+            blocks[count++] = block + i * size;
+    }
+
+    return count;
+}
+
+void FreeBlockBatch(char** blocks, size_t n)
+{
+    // adjacent blocks end up next to each other
+    std::sort(blocks, blocks + n);
+
+    // null pointers are sorted first
+    size_t i = 0;
+    while (i < n && blocks[i] == nullptr)
+        ++i;
+
+    while (i < n)
+    {
+        // merge run of adjacent blocks in the same chunk
+        PageInfo info = sPageMap.GetPageInfo(blocks[i]);
+        ASSERT(info.GetSize() > 0 && !info.IsSlab());
+        TKey key(info.GetSize(), blocks[i]);
+        bool merged = false;
+        for (++i; i < n; ++i)
+        {
+            char* next = blocks[i];
+            if (next != key.address + key.size ||
+                    sPageMap.GetPageInfo(next - PAGE).IsChunkEnd())
+                break;
+
+            PageInfo nextInfo = sPageMap.GetPageInfo(next);
+            ASSERT(nextInfo.GetSize() > 0 && !nextInfo.IsSlab());
+            TKey k(nextInfo.GetSize(), next);
+            if (!merged)
+                ClearBlock(key);
+
+            ClearBlock(k);
+            key.size += k.size;
+            merged = true;
+        }
+
+        if (merged)
+            SetBlock(key);
+
+        FreeBlock(key);
+    }
+}
+
+bool ResizeBlock(TKey key, size_t size)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+    ASSERT(size > 0);
+    // a wrapped size would free the whole block as the tail
+    if (UNLIKELY(size == 0))
+        return false;
+
+    if (size == key.size)
+        return true;
+
+    if (UNLIKELY(sPageMap.GetPageInfo(key.address).IsDirect()))
+    {
+        if (size > key.size)
+            return false;
+
+        // shrink, chunk ends with the block, tail is unmapped
+        TKey newKey(size, key.address);
+        sPageMap.SetPageInfo(key.address, PageInfo(0));
+        sPageMap.SetPageInfo(key.address + key.size - PAGE, PageInfo(0));
+        sRegularChunkBytes.fetch_sub(key.size);
+        SetChunk(newKey, GetArenaForPtr(key.address), false, true);
+        SetBlock(newKey);
+        PageFree(key.address + size, key.size - size);
+        return true;
+    }
+
+    if (size < key.size)
+    {
+        // shrink, free tail as a regular block
+        ClearBlock(key);
+        SetBlock(TKey(size, key.address));
+        TKey tail(key.size - size, key.address + size);
+        SetBlock(tail);
+        FreeBlock(tail);
+        return true;
+    }
+
+    // grow, only possible if next block is free and large enough
+    // same as forward coalescing in FreeBlock
+    if (sPageMap.GetPageInfo(key.address + key.size - PAGE).IsChunkEnd())
+        return false;
+
+    char* nextBlock = (char*)(key.address + key.size);
+    PageInfo info = sPageMap.GetPageInfo(nextBlock);
+    if (info.GetSize() <= 0 || info.IsSlab())
+        return false;
+
+    TKey k((size_t)info.GetSize(), nextBlock);
+    if (key.size + k.size < size)
+        return false;
+
+    // try to acquire next block
+    // can fail if: block not free, or does not exist
+    Arena* arena = &sArenas[GetArenaForPtr(key.address)];
+    if (!arena->tree.Remove(k))
+        return false;
+
+    // update page map
+    bool clean = ClearBlock(k);
+    ClearBlock(key);
+    SetBlock(TKey(size, key.address));
+
+    // leftover of next block remains free
+    size_t loSize = key.size + k.size - size;
+    if (loSize > 0)
+    {
+        TKey lo(loSize, key.address + size);
+        SetBlock(lo, clean);
+        InsertBlock(arena, lo, clean);
+    }
+
+    return true;
+}
+
+char* AllocChunkBlock(size_t size, bool direct /*= false*/)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+
+    char* block = (char*)PageAllocChunk(size);
+    if (UNLIKELY(block == nullptr))
+        return nullptr;
+
+    TKey key(size, block);
+    // update page map
+    SetChunk(key, GetCurrentArena(), false, direct);
     SetBlock(key);
+    return block;
+}
 
-    bool res = sTree.Insert(key);
-    (void)res; // suppress warning
-    // insert can't failblockSize own the block
-    ASSERT(res);
+char* RemapBlock(TKey key, size_t size)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+
+    // block must be a whole chunk, and hugetlb chunks are never unmapped
+    PageInfo start = sPageMap.GetPageInfo(key.address);
+    PageInfo end = sPageMap.GetPageInfo(key.address + key.size - PAGE);
+    if (!start.IsChunkStart() || !end.IsChunkEnd() || start.IsHugeTLB())
+        return nullptr;
+
+    // reserve an aligned range, remapping replaces it
+    char* block = (char*)PageAllocChunk(size);
+    if (UNLIKELY(block == nullptr))
+        return nullptr;
+
+    // old range may be reused by other threads as soon as it's remapped
+    //  so its page map info must be cleared first
+    sPageMap.SetPageInfo(key.address, PageInfo(0));
+    sPageMap.SetPageInfo(key.address + key.size - PAGE, PageInfo(0));
+
+    void* ptr = mremap(key.address, key.size, size,
+            MREMAP_MAYMOVE | MREMAP_FIXED, block);
+    if (UNLIKELY(ptr == MAP_FAILED))
+    {
+        // restore page map info
+        sPageMap.SetPageInfo(key.address, start);
+        sPageMap.SetPageInfo(key.address + key.size - PAGE, end);
+        PageFree(block, size);
+        return nullptr;
+    }
+
+    sRegularChunkBytes.fetch_sub(key.size);
+
+    TKey newKey(size, block);
+    // update page map
+    SetChunk(newKey, GetArenaForPtr(key.address), false, start.IsDirect());
+    SetBlock(newKey);
+    return block;
 }
@@ -10,30 +10,157 @@
 
 #include "pagemap.h"
 #include "lfbstree.h"
+#include "lfskiplist.h"
+
+// free block index, selected at build time
+// both take the fit policy selected by FIT_POLICY
+#define BLOCK_INDEX_TREE 0
+#define BLOCK_INDEX_SKIPLIST 1
+
+#ifndef BLOCK_INDEX
+#define BLOCK_INDEX BLOCK_INDEX_TREE
+#endif
+
+#if BLOCK_INDEX == BLOCK_INDEX_TREE
+typedef LFBSTree BlockIndex;
+#elif BLOCK_INDEX == BLOCK_INDEX_SKIPLIST
+typedef LFSkipList BlockIndex;
+#else
+#error "Invalid BLOCK_INDEX"
+#endif
+
+// blocks up to this many pages are kept in exact-size free lists
+//  when they can't be coalesced, instead of being inserted in the tree
+#define BLOCK_STACK_MAX_PAGES 16
+
+// lazy coalescing
+// if enabled, freed blocks go to free lists without being coalesced, and are
+//  only coalesced when an allocation would otherwise go to the OS, or when
+//  free lists hold more than LAZY_MAX_BYTES
+// can be changed at runtime
+#ifndef LAZY_COALESCING
+#define LAZY_COALESCING 0
+#endif
+#define LAZY_MAX_BYTES ((size_t)64 << 20)
+
+// purging
+// free blocks that stay in the tree for longer than the decay time
+//  have their pages returned to the OS with PURGE_ADVICE, and chunks
+//  obtained from the OS that become entirely free are unmapped
+// purging is amortized in FreeBlock, each thread purges blocks it freed
+#define PURGE_ADVICE MADV_DONTNEED
+// default decay time, in milliseconds
+#define PURGE_DECAY_MS 10000
+// max number of blocks per thread waiting for decay
+//  when exceeded, oldest block is purged early
+#define PURGE_QUEUE_SIZE 256
+// check for decayed blocks every this many frees
+#define PURGE_CHECK_FREQ 64
+
+// blocks at least this large that are backed by their own chunk are
+//  moved by remapping their pages, instead of copying them
+#define REMAP_MIN_SIZE ((size_t)4 << 20)
+
+// direct blocks
+// allocations of at least the direct threshold are mapped on a chunk of
+//  their own, which is unmapped as soon as they are freed, without entering
+//  the block index, so huge blocks are never split for smaller requests
+// default threshold, can be changed at runtime
+#define DIRECT_MIN_SIZE ((size_t)8 << 20)
+// adaptive threshold
+// freeing a direct block raises the threshold past its size, up to
+//  DIRECT_MAX_SIZE, so sizes that are repeatedly allocated and freed are
+//  reused from the block index instead of being mapped every time
+// disabled once the threshold is set at runtime
+#define DIRECT_ADAPTIVE 1
+#define DIRECT_MAX_SIZE ((size_t)64 << 20)
 
 // global variables
-// block tree
-extern LFBSTree sTree;
+// bytes of chunks currently mapped from the OS, by source
+// hugetlb chunks are never unmapped
+extern std::atomic<size_t> sRegularChunkBytes;
+extern std::atomic<size_t> sHugeTLBChunkBytes;
+// lazy coalescing mode, see LAZY_COALESCING
+extern std::atomic<bool> sLazyCoalescing;
+// decay time, in milliseconds
+// if 0, blocks are purged as soon as they are freed
+// if < 0, purging is disabled
+extern std::atomic<int64_t> sPurgeDecayMs;
+// direct threshold, in bytes
+// SIZE_MAX disables direct blocks
+extern std::atomic<size_t> sDirectMinSize;
+// if false, direct threshold is fixed
+extern std::atomic<bool> sDirectAdaptive;
 
 // PageMap::UpdatePageInfo wrappers
-void SetBlock(TKey key);
-void ClearBlock(TKey key);
+// both preserve chunk flags of updated pages
+// if clean = true, block is marked as purged
+void SetBlock(TKey key, bool clean = false);
+// returns true if block was marked as purged
+bool ClearBlock(TKey key);
+// update page info, preserving chunk flags
+void SetPageInfoKeepChunk(char* ptr, PageInfo info);
 
 static inline PageInfo GetPageInfoForPtr(char* ptr)
 {
     return sPageMap.GetPageInfo(ptr);
 }
 
+// detects numa nodes and initializes one block index per arena
+// must be called before any alloc/free
+void InitArenas();
+
 // allocate block
+// blocks are taken from the arena of the calling thread's numa node
 // if os = 0, using only internal storage
 // if os > 0, if a block cannot be found in internal storage, allocates
 //  a block with size max(os, size) from the OS
-char* AllocBlock(size_t size, size_t os = HUGEPAGE);
+// if zeroed != nullptr, it's set to true if the block is known to be
+//  zero-filled, either fresh from the OS or purged
+char* AllocBlock(size_t size, size_t os = HUGEPAGE, bool* zeroed = nullptr);
+// allocate block whose address is a multiple of align
+// align must be a power of 2, remainders are freed
+char* AllocBlockAligned(size_t size, size_t align);
+// allocate up to n blocks of `size` bytes, carved from a single block
+// returns number of blocks allocated, stored in `blocks`
+// returns 0 if n * size overflows
+size_t AllocBlockBatch(size_t size, size_t n, char** blocks);
 // free a previously allocated block
+// block is returned to the arena that owns its address
 // if recursiveCoa = true, uses a recursive coalescing strategy
 // otherwise does a single coalescing attempt
+// direct blocks are unmapped instead
 void FreeBlock(TKey key, bool recursiveCoa = false);
+// resize a previously allocated block in place, size must be a PAGE multiple
+// when growing, absorbs the free block that follows it, if large enough
+// when shrinking, the tail is freed, or unmapped for direct blocks
+// direct blocks can't grow in place, see RemapBlock
+// returns false if the block can't be resized in place
+bool ResizeBlock(TKey key, size_t size);
+// allocate a block backed by its own chunk from the OS
+// such blocks can later be moved with RemapBlock
+// if direct = true, chunk is unmapped when the block is freed, see
+//  DIRECT_MIN_SIZE
+char* AllocChunkBlock(size_t size, bool direct = false);
+// true if blocks with `size` bytes should be direct blocks
+static inline bool IsDirectSize(size_t size)
+{
+    return size >= sDirectMinSize.load(std::memory_order_relaxed);
+}
+// move a block backed by its own chunk to a new chunk with `size` bytes,
+//  by remapping its pages
+// returns new block address, or nullptr if block can't be remapped
+char* RemapBlock(TKey key, size_t size);
+// free n previously allocated blocks
+// adjacent blocks are coalesced before being freed, `blocks` is sorted
+void FreeBlockBatch(char** blocks, size_t n);
 // allocate `pages` from OS and add to storage
-void ReserveBlockFromOS(size_t pages);
+// if hugetlbSize > 0, tries to back the block with hugetlb pages of that
+//  size, rounding it up to a hugetlbSize multiple, and falls back to regular
+//  pages if the hugetlb pool is exhausted
+void ReserveBlockFromOS(size_t pages, size_t hugetlbSize = 0);
+// purge blocks freed by calling thread whose decay time expired
+// if force = true, purges all of them regardless of decay time
+void PurgeBlocks(bool force = false);
 
 #endif // __INTERNAL_H
@@ -6,101 +6,200 @@
 #include <limits>
 #include <utility>
 #include "lfbstree.h"
-#include "pages.h"
+#include "nodepool.h"
+#include "reclaim.h"
 #include "log.h"
 
+// tree leaves only need a key
+// edges to leaves are marked, see NODE_CHILD_LEAF_MASK
+struct LeafNode
+{
+    TKey key;
+};
+
+STATIC_ASSERT(offsetof(Node, key) == offsetof(LeafNode, key), "Invalid LeafNode");
+STATIC_ASSERT(sizeof(LeafNode) % (NODE_CHILD_LEAF_MASK << 1) == 0,
+        "LeafNode too small to keep edge bits free");
+
 // internal memory allocation helpers
-Node* AllocNode();
-void RetireNode(Node* node);
+static Node* AllocLeaf(TKey key);
+static void FreeLeaf(Node* leaf);
+void RetireNode(Node* node, bool leaf);
+
+// hazard slots, only used with hazard pointer reclamation
+// nodes only ever move from a slot to a higher slot, so that
+//  a concurrent scan can't miss a node while it is being moved
+#define HP_CURR         0
+#define HP_LEAF         1
+#define HP_PARENT       2
+#define HP_SUCCESSOR    3
+#define HP_ANCESTOR     4
+#define HP_REMOVE       5
+#define HP_NUM_SLOTS    6
+
+STATIC_ASSERT(HP_NUM_SLOTS <= RECLAIM_NUM_HAZARDS, "Too many hazard slots");
+STATIC_ASSERT(alignof(LeafNode) > RECLAIM_KIND_MASK, "Leaves can't be retired");
 
 // global variables
-// static std::atomic<char*> HeadNode(nullptr);
-static __thread char* HeadNode = nullptr;
+static NodePool sNodePool = { MagazineHead { nullptr, 0 }, sizeof(Node) };
+static NodePool sLeafPool = { MagazineHead { nullptr, 0 }, sizeof(LeafNode) };
+
+// thread-local variables
+static __thread NodeCache sNodeCache;
+static __thread NodeCache sLeafCache;
+#if LFBSTREE_SPREAD_OPS
+// RemoveNext operations left to start at a random address
+static __thread size_t sSpreadOps = 0;
+static __thread uint64_t sSpreadSeed = 0;
+#endif
+
+#if LFBSTREE_RECLAIM == LFBSTREE_RECLAIM_EBR
+// epoch-based reclamation, see reclaim.h
+// threads announce the global epoch when they start a tree operation, so
+//  no thread that could have reached a retired node during a Seek is still
+//  operating on the tree once it is reused
+typedef EpochGuard ReclaimGuard;
+
+// nodes are protected by the guard, nothing to do
+CMALLOC_INLINE void HazardCopy(size_t /*slot*/, Node* /*node*/) { }
+
+CMALLOC_INLINE bool HazardProtect(size_t /*slot*/, Node* /*node*/,
+        std::atomic<NodeChild>* /*edgePtr*/, NodeChild /*edge*/,
+        std::atomic<NodeChild>* /*ancestorEdge*/, Node* /*successor*/)
+{
+    return true;
+}
+
+#elif LFBSTREE_RECLAIM == LFBSTREE_RECLAIM_HP
+// hazard pointer reclamation, see reclaim.h
+// Seek publishes every node it is about to dereference, and only proceeds
+//  once the node is known to still be reachable
+typedef HazardGuard ReclaimGuard;
 
-// forward arguments
-template<class T>
-Node* AllocNode(T&& arg)
+// publish node that is already protected by another slot
+CMALLOC_INLINE void HazardCopy(size_t slot, Node* node)
 {
-    // size of page blocks to carve up nodes from
-    size_t const blockSize = HUGEPAGE;
+    PublishHazard(slot, node);
+}
 
-    while (true)
-    {
-        // char* head = HeadNode.load();
-        char* head = HeadNode;
-        if (head == nullptr)
-        {
-            // pages are 0-filled
-            char* buffer = (char*)PageAlloc(blockSize);
-            // carve up buffer into a node list
-            size_t numNodes = blockSize / sizeof(Node);
-            for (size_t i = 0; i < numNodes - 1; ++i)
-            {
-                char* node = buffer + i * sizeof(Node);
-                char* next = buffer + (i + 1) * sizeof(Node);
-                *((char**)node) = (char*)next;
-            }
+// publish node read from `edge`, then check that it is still reachable
+// if `edge` is marked its owner may have already been removed, but then
+//  all edges between `successor` and it are marked and can't change, so
+//  it is enough to check that `ancestorEdge` still leads to `successor`
+CMALLOC_INLINE bool HazardProtect(size_t slot, Node* node,
+        std::atomic<NodeChild>* edgePtr, NodeChild edge,
+        std::atomic<NodeChild>* ancestorEdge, Node* successor)
+{
+    PublishHazard(slot, node);
+    if (edgePtr->load() != edge)
+        return false;
 
-            *(char**)(buffer + (numNodes - 1) * sizeof(Node)) = nullptr;
-            HeadNode = buffer;
-            /*
-            if (!HeadNode.compare_exchange_strong(head, buffer))
-                PageFree(buffer, blockSize);
-            */
+    if (!edge.IsFlagged() && !edge.IsTagged())
+        return true;
 
-            continue;
-        }
+    return ancestorEdge->load() == NodeChild(successor);
+}
 
-        char* next = *((char**)head);
-        HeadNode = next;
-        Node* node = new (head) Node(arg);
-        return node;
+#else
+#error "Invalid LFBSTREE_RECLAIM"
+#endif
 
-        /*
-        if (HeadNode.compare_exchange_weak(head, next))
-        {
-            // https://stackoverflow.com/questions/519808/call-a-constructor-on-a-already-allocated-memory
-            Node* node = new (head) Node(arg);
-            return node;
-        }
-        */
-    }
+Node* AllocNode(TKey key)
+{
+    char* slot = PoolAlloc(sNodeCache, sNodePool);
+    // https://stackoverflow.com/questions/519808/call-a-constructor-on-a-already-allocated-memory
+    return new (slot) Node(key);
+}
+
+// node must not be reachable by any other thread
+void FreeNode(Node* node)
+{
+    PoolFree(sNodeCache, sNodePool, (char*)node);
+}
+
+static Node* AllocLeaf(TKey key)
+{
+    char* slot = PoolAlloc(sLeafCache, sLeafPool);
+    new (slot) LeafNode{key};
+    return (Node*)slot;
+}
+
+// leaf must not be reachable by any other thread
+static void FreeLeaf(Node* leaf)
+{
+    PoolFree(sLeafCache, sLeafPool, (char*)leaf);
+}
+
+static void RecycleNode(void* node)
+{
+    FreeNode((Node*)node);
+}
+
+static void RecycleLeaf(void* leaf)
+{
+    FreeLeaf((Node*)leaf);
+}
+
+// node is unreachable, but may still be in use by concurrent Seeks
+void RetireNode(Node* node, bool leaf)
+{
+    size_t kind = leaf ? RECLAIM_TREE_LEAF : RECLAIM_TREE_NODE;
+#if LFBSTREE_RECLAIM == LFBSTREE_RECLAIM_EBR
+    RetireEpoch(node, kind);
+#else
+    RetireHazard(node, kind);
+#endif
+}
+
+template<typename Fit>
+size_t LFBSTreeT<Fit>::GetNumRetiredNodes()
+{
+    return GetNumRetiredEntries();
+}
+
+template<typename Fit>
+void LFBSTreeT<Fit>::ThreadFinalize()
+{
+    // hand off retired nodes, then free node lists, as handing off may
+    //  recycle nodes
+    ReclaimThreadFinalize();
+    PoolFlush(sNodeCache, sNodePool);
+    PoolFlush(sLeafCache, sLeafPool);
 }
 
-void RetireNode(Node* /*node*/) { /* no-op */ }
 
 // `old` subtree is no longer reachable and is being removed from tree
 // it was replaced by `existing`, which is a descendant of `old`
-void RetireSubtree(Node* old, Node* existing)
+void RetireSubtree(NodeChild old, Node* existing)
 {
-    RetireNode(old);
-    NodeChild left = old->left.load();
-    NodeChild right = old->right.load();
-    Node* leftNode = left.GetPtr();
-    Node* rightNode = right.GetPtr();
+    Node* node = old.GetPtr();
     // leaf nodes have no children
     // internal nodes have both children
-    ASSERT((bool)leftNode == (bool)rightNode);
-    if (leftNode)
+    if (!old.IsLeaf())
     {
+        NodeChild left = node->left.load();
+        NodeChild right = node->right.load();
+        ASSERT(left.GetPtr() && right.GetPtr());
+
         ASSERT(left.IsFlagged() || left.IsTagged());
-        if (leftNode == existing)
+        if (left.GetPtr() == existing)
             ASSERT(left.IsTagged());
         else
-            RetireSubtree(leftNode, existing);
-    }
+            RetireSubtree(left, existing);
 
-    if (rightNode)
-    {
         ASSERT(right.IsFlagged() || right.IsTagged());
-        if (rightNode == existing)
+        if (right.GetPtr() == existing)
             ASSERT(right.IsTagged());
         else
-            RetireSubtree(rightNode, existing);
+            RetireSubtree(right, existing);
     }
+
+    // retire only after reading children, node may be immediately reused
+    RetireNode(node, old.IsLeaf());
 }
 
-LFBSTree::LFBSTree()
+template<typename Fit>
+LFBSTreeT<Fit>::LFBSTreeT()
 {
     // assemble initial tree structure
     //          R           //
@@ -110,6 +209,9 @@ LFBSTree::LFBSTree()
     //  oo0   oo1           //
     // R has initial value 
 
+    SetRecycleFunc(RECLAIM_TREE_NODE, RecycleNode);
+    SetRecycleFunc(RECLAIM_TREE_LEAF, RecycleLeaf);
+
     auto limits = std::numeric_limits<size_t>();
     TKey const oo2 = TKey(limits.max() - 0U);
     TKey const oo1 = TKey(limits.max() - 1U);
@@ -122,93 +224,140 @@ LFBSTree::LFBSTree()
     _S = AllocNode(oo1);
     // init R
     _R->left.store(NodeChild(_S));
-    _R->right.store(NodeChild(AllocNode(oo2)));
+    _R->right.store(NodeChild(false, false, true, AllocLeaf(oo2)));
     // init S
-    _S->left.store(NodeChild(AllocNode(oo0)));
-    _S->right.store(NodeChild(AllocNode(oo1)));
+    _S->left.store(NodeChild(false, false, true, AllocLeaf(oo0)));
+    _S->right.store(NodeChild(false, false, true, AllocLeaf(oo1)));
 
     ASSERT(_R);
     ASSERT(_S);
+
+    _minAddress.store((char*)std::numeric_limits<uintptr_t>::max());
+    _maxAddress.store(nullptr);
 }
 
-LFBSTree::~LFBSTree() { }
+template<typename Fit>
+LFBSTreeT<Fit>::~LFBSTreeT() { }
 
-SeekRecord LFBSTree::Seek(TKey key)
+template<typename Fit>
+SeekRecord LFBSTreeT<Fit>::Seek(TKey key)
 {
-    std::atomic<NodeChild>* ancestorEdge = &_R->left;
-    Node* successor = _S;
-    Node* parent = _S;
-    Node* leaf = _S->left.load().GetPtr();
-    // needed for RemoveNext operation
-    TKey lastLeftKey = _R->key;
-
-    ASSERT(leaf);
-
-    std::atomic<NodeChild>* parentEdgePtr = &parent->left;
-    std::atomic<NodeChild>* leafEdgePtr = &leaf->left;
-    NodeChild parentEdge = parentEdgePtr->load();
-    NodeChild leafEdge = leafEdgePtr->load();
-
-    Node* curr = leafEdge.GetPtr();
-    while (curr != nullptr)
+    // with hazard pointers, seek restarts if a node can't be protected
+    while (true)
     {
-        // leafEdge/parentEdge contain known addresses
-        ASSERT((size_t)parent + offsetof(Node, left) == (size_t)parentEdgePtr ||
-               (size_t)parent + offsetof(Node, right) == (size_t)parentEdgePtr);
-        ASSERT((size_t)leaf + offsetof(Node, left) == (size_t)leafEdgePtr ||
-               (size_t)leaf + offsetof(Node, right) == (size_t)leafEdgePtr);
-
-        // parent is an internal node
-        // and internal nodes always have both childs
-        NodeChild leftChild = parent->left.load();
-        NodeChild rightChild = parent->right.load();
-        (void)leftChild;
-        (void)rightChild; // suppress unused warning
-        // parent is an internal node and must have 2 child ptrs
-        ASSERT(leftChild.GetPtr() && rightChild.GetPtr());
-
-        // update ancestor/successor if leaf isn't tagged for removal
-        // leaf is an internal node, can't be flagged
-        ASSERT(!parentEdge.IsFlagged() || parentEdge.GetPtr() != leaf);
-        if (!parentEdge.IsTagged())
+        std::atomic<NodeChild>* ancestorEdge = &_R->left;
+        Node* successor = _S;
+        Node* parent = _S;
+        std::atomic<NodeChild>* parentEdgePtr = &parent->left;
+        NodeChild parentEdge = parentEdgePtr->load();
+        Node* leaf = parentEdge.GetPtr();
+        // needed for RemoveNext operation
+        TKey lastLeftKey = _R->key;
+
+        ASSERT(leaf);
+
+        if (!HazardProtect(HP_LEAF, leaf, parentEdgePtr, parentEdge,
+                    ancestorEdge, successor))
+            continue;
+
+        std::atomic<NodeChild>* leafEdgePtr = &leaf->left;
+        NodeChild leafEdge;
+        Node* curr = nullptr;
+        // S subtree may be a single leaf, which has no edges
+        if (!parentEdge.IsLeaf())
         {
-            ancestorEdge = parentEdgePtr;
-            successor = leaf;
+            leafEdge = leafEdgePtr->load();
+            curr = leafEdge.GetPtr();
         }
 
-        // update parent/leaf
-        parent = leaf;
-        leaf = curr;
-
-        // and parentEdge/leafEdge
-        parentEdgePtr = leafEdgePtr;
-        parentEdge = leafEdge;
-        if (leaf->key > key)
+        bool valid = true;
+        while (curr != nullptr)
         {
-            lastLeftKey = leaf->key;
-            leafEdgePtr = &leaf->left;
+            // leafEdge/parentEdge contain known addresses
+            ASSERT((size_t)parent + offsetof(Node, left) == (size_t)parentEdgePtr ||
+                   (size_t)parent + offsetof(Node, right) == (size_t)parentEdgePtr);
+            ASSERT((size_t)leaf + offsetof(Node, left) == (size_t)leafEdgePtr ||
+                   (size_t)leaf + offsetof(Node, right) == (size_t)leafEdgePtr);
+
+            // protect curr before dereferencing it
+            // if parent -> leaf edge isn't tagged, it will be the ancestor edge
+            valid = !parentEdge.IsTagged() ?
+                HazardProtect(HP_CURR, curr, leafEdgePtr, leafEdge,
+                        parentEdgePtr, leaf) :
+                HazardProtect(HP_CURR, curr, leafEdgePtr, leafEdge,
+                        ancestorEdge, successor);
+            if (!valid)
+                break;
+
+            // parent is an internal node
+            // and internal nodes always have both childs
+            NodeChild leftChild = parent->left.load();
+            NodeChild rightChild = parent->right.load();
+            (void)leftChild;
+            (void)rightChild; // suppress unused warning
+            // parent is an internal node and must have 2 child ptrs
+            ASSERT(leftChild.GetPtr() && rightChild.GetPtr());
+
+            // update ancestor/successor if leaf isn't tagged for removal
+            // leaf is an internal node, can't be flagged
+            ASSERT(!parentEdge.IsFlagged() || parentEdge.GetPtr() != leaf);
+            if (!parentEdge.IsTagged())
+            {
+                ancestorEdge = parentEdgePtr;
+                successor = leaf;
+                HazardCopy(HP_ANCESTOR, parent);
+                HazardCopy(HP_SUCCESSOR, leaf);
+            }
+
+            // update parent/leaf
+            parent = leaf;
+            leaf = curr;
+            HazardCopy(HP_PARENT, parent);
+            HazardCopy(HP_LEAF, leaf);
+
+            // and parentEdge/leafEdge
+            parentEdgePtr = leafEdgePtr;
+            parentEdge = leafEdge;
+            bool goLeft = Fit::Greater(leaf->key, key);
+            if (goLeft)
+                lastLeftKey = leaf->key;
+
+            // reached a leaf, which has no edges
+            if (parentEdge.IsLeaf())
+                break;
+
+            leafEdgePtr = goLeft ? &leaf->left : &leaf->right;
+            leafEdge = leafEdgePtr->load();
+            // update curr
+            curr = leafEdge.GetPtr();
+
+#if LFBSTREE_RECLAIM == LFBSTREE_RECLAIM_EBR
+            // with hazard pointers curr isn't protected yet, and may have
+            //  already been reused
+            ASSERT(!curr || Fit::Greater(leaf->key, curr->key) == (leafEdgePtr == &leaf->left));
+#endif
         }
-        else
-            leafEdgePtr = &leaf->right;
 
-        leafEdge = leafEdgePtr->load();
-        // update curr
-        curr = leafEdge.GetPtr();
+        if (!valid)
+            continue;
 
-        ASSERT(!curr || (leaf->key > curr->key) == (leafEdgePtr == &leaf->left));
+        SeekRecord record;
+        record.ancestorEdge = ancestorEdge;
+        record.successor = successor;
+        record.parent = parent;
+        record.leaf = leaf;
+        record.lastLeftKey = lastLeftKey;
+        return record;
     }
-
-    SeekRecord record;
-    record.ancestorEdge = ancestorEdge;
-    record.successor = successor;
-    record.parent = parent;
-    record.leaf = leaf;
-    record.lastLeftKey = lastLeftKey;
-    return record;
 }
 
-bool LFBSTree::Insert(TKey key)
+template<typename Fit>
+bool LFBSTreeT<Fit>::Insert(TKey key)
 {
+    ReclaimGuard guard;
+    // new nodes are only allocated once, and reused if CAS fails
+    Node* newLeaf = nullptr;
+    Node* newInternal = nullptr;
     while (true)
     {
         SeekRecord record = Seek(key);
@@ -217,34 +366,60 @@ bool LFBSTree::Insert(TKey key)
         if (leaf->key == key)
         {
             ASSERT(false);
+            if (newLeaf)
+            {
+                FreeLeaf(newLeaf);
+                FreeNode(newInternal);
+            }
+
             return false;
         }
 
-        Node* newLeaf = AllocNode(key);
-        Node* newInternal = AllocNode(key);
-        if (leaf->key > key)
+        if (newLeaf == nullptr)
+        {
+            newLeaf = AllocLeaf(key);
+            newInternal = AllocNode(key);
+        }
+
+        // record.leaf is always a leaf
+        NodeChild newLeafEdge(false, false, true, newLeaf);
+        NodeChild leafEdge(false, false, true, leaf);
+        newInternal->key = key;
+        if (Fit::Greater(leaf->key, key))
         {
             newInternal->key = leaf->key; // update key
-            newInternal->left.store(newLeaf);
-            newInternal->right.store(leaf);
+            newInternal->left.store(newLeafEdge);
+            newInternal->right.store(leafEdge);
         }
         else
         {
-            newInternal->left.store(leaf);
-            newInternal->right.store(newLeaf);
+            newInternal->left.store(leafEdge);
+            newInternal->right.store(newLeafEdge);
         }
 
         ASSERT(newInternal->right.load().GetPtr()->key == newInternal->key);
-        ASSERT(newInternal->key > newInternal->left.load().GetPtr()->key);
+        ASSERT(Fit::Greater(newInternal->key, newInternal->left.load().GetPtr()->key));
 
         Node* parent = record.parent;
-        std::atomic<NodeChild>* childAddr = (parent->key > key) ?
+        std::atomic<NodeChild>* childAddr = Fit::Greater(parent->key, key) ?
             &parent->left : &parent->right;
 
-        NodeChild expected(leaf);
+        NodeChild expected = leafEdge;
         NodeChild desired(newInternal);
         if (childAddr->compare_exchange_strong(expected, desired))
+        {
+#if LFBSTREE_SPREAD_OPS
+            // range only grows when new chunks are mapped
+            char* min = _minAddress.load(std::memory_order_relaxed);
+            while (key.address < min &&
+                !_minAddress.compare_exchange_weak(min, key.address));
+
+            char* max = _maxAddress.load(std::memory_order_relaxed);
+            while (key.address > max &&
+                !_maxAddress.compare_exchange_weak(max, key.address));
+#endif
             return true;
+        }
 
         // CAS failed, either someone only added a node
         // (and/or) leaf is flagged/tagged
@@ -255,83 +430,148 @@ bool LFBSTree::Insert(TKey key)
     }
 }
 
-bool LFBSTree::Remove(TKey key)
+template<typename Fit>
+bool LFBSTreeT<Fit>::Remove(TKey key)
 {
+    ReclaimGuard guard;
     while (true)
     {
         SeekRecord record = Seek(key);
-        Node* leaf = record.leaf;
-        if (leaf->key != key)
+        if (record.leaf->key != key)
             return false;
 
-        Node* parent = record.parent;
-        std::atomic<NodeChild>* parentEdge = (parent->key > key) ?
-            &parent->left : &parent->right;
+        if (FlagLeaf(key, record))
+            return true;
+    }
+}
 
-        NodeChild expected(leaf);
-        NodeChild desired(true, false, leaf);
-        if (!parentEdge->compare_exchange_weak(expected, desired))
+template<typename Fit>
+bool LFBSTreeT<Fit>::RemoveNext(TKey& key)
+{
+    // need to be careful not to accidentally remove one of the static nodes
+    auto limits = std::numeric_limits<size_t>();
+    TKey const oo0 = TKey(limits.max() - 2U);
+    ReclaimGuard guard;
+#if LFBSTREE_SPREAD_OPS
+    // recently contended, first look for a key of the same size above a
+    //  random address
+    char* min = _minAddress.load(std::memory_order_relaxed);
+    char* max = _maxAddress.load(std::memory_order_relaxed);
+    if (sSpreadOps > 0 && min < max)
+    {
+        --sSpreadOps;
+        // xorshift64
+        uint64_t x = sSpreadSeed ? sSpreadSeed : (uint64_t)&guard | 1U;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        sSpreadSeed = x;
+
+        // key is the smallest key that fits, so the next one bounds its bucket
+        TKey spreadKey(key.size, min + x % (size_t)(max - min));
+        TKey const limit = Fit::FitKey(key.size + 1);
+        if (RemoveRange(spreadKey, limit))
         {
-            // CAS failed, either because edge is already tagged or flagged
-            // or leaf value changed
-            if (expected.GetPtr() == leaf &&
-                (expected.IsFlagged() || expected.IsTagged()))
-                Cleanup(key, record);
-
-            // try again
-            continue;
+            key = spreadKey;
+            return true;
         }
+    }
+#endif
 
-        // CAS succeeded, node is flagged
-        // now need to remove it from tree
-        if (Cleanup(key, record))
-            return true; // successfully removed from tree
+    return RemoveRange(key, oo0);
+}
 
-        // if cleanup failed, someone else might have removed node
-        while (true)
-        {
-            SeekRecord newRecord = Seek(key);
-            // someone else removed key
-            // key might exist in tree (e.g record.leaf->key == key), but
-            //  marked leaf was removed
-            if (newRecord.leaf != leaf)
-                return true;
-
-            if (Cleanup(key, newRecord))
-                return true; // successfully removed from tree
-        }
+template<typename Fit>
+bool LFBSTreeT<Fit>::FlagLeaf(TKey key, SeekRecord& record)
+{
+    // record.leaf holds key, try to flag its parent edge and remove it
+    // if false, leaf was removed or the edge changed and caller must seek again
+    Node* leaf = record.leaf;
+    Node* parent = record.parent;
+    std::atomic<NodeChild>* parentEdge = Fit::Greater(parent->key, key) ?
+        &parent->left : &parent->right;
+
+    NodeChild expected(false, false, true, leaf);
+    NodeChild desired(true, false, true, leaf);
+    if (!parentEdge->compare_exchange_weak(expected, desired))
+    {
+        // CAS failed, either because edge is already tagged or flagged
+        // or leaf value changed
+        if (expected.GetPtr() == leaf &&
+            (expected.IsFlagged() || expected.IsTagged()))
+            Cleanup(key, record);
+
+        return false;
+    }
+
+    // CAS succeeded, node is flagged
+    // now need to remove it from tree
+    // keep leaf protected, as it is compared against later seeks
+    HazardCopy(HP_REMOVE, leaf);
+    if (Cleanup(key, record))
+        return true; // successfully removed from tree
+
+    // if cleanup failed, someone else might have removed node
+    while (true)
+    {
+        SeekRecord newRecord = Seek(key);
+        // someone else removed key
+        // key might exist in tree (e.g record.leaf->key == key), but
+        //  marked leaf was removed
+        if (newRecord.leaf != leaf)
+            return true;
+
+        if (Cleanup(key, newRecord))
+            return true; // successfully removed from tree
     }
 }
 
-bool LFBSTree::RemoveNext(TKey& key)
+template<typename Fit>
+bool LFBSTreeT<Fit>::RemoveRange(TKey& key, TKey const& limit)
 {
-    // given key, remove smallest key from tree that is >= key
-    // need to be careful not to accidentally remove one of the static nodes
-    auto limits = std::numeric_limits<size_t>();
-    TKey oo0 = TKey(limits.max() - 2U);
-    while (oo0 > key)
+    // given key, remove smallest key from tree that is >= key and < limit
+    while (Fit::Greater(limit, key))
     {
         SeekRecord record = Seek(key);
         Node* leaf = record.leaf;
-        if (leaf->key == key && Remove(key))
+        TKey leafKey = leaf->key;
+        if (Fit::Greater(key, leafKey))
+        {
+            // leaf precedes key, iteratively increase to parent's key
+            ASSERT(Fit::Greater(record.lastLeftKey, key));
+            key = record.lastLeftKey;
+            continue;
+        }
+
+        // seek ends next to key, so leaf holds the smallest key >= key
+        // and the same path leads to it, no need to seek again to remove it
+        if (!Fit::Greater(limit, leafKey))
+            return false;
+
+        if (FlagLeaf(leafKey, record))
+        {
+            key = leafKey;
             return true;
+        }
 
-        // if key not in tree, iteratively increase to parent's key
-        ASSERT(record.lastLeftKey > key);
-        key = record.lastLeftKey; 
+#if LFBSTREE_SPREAD_OPS
+        // lost leaf to another thread
+        sSpreadOps = LFBSTREE_SPREAD_OPS;
+#endif
     }
 
     return false;
 }
 
-bool LFBSTree::Cleanup(TKey key, SeekRecord& record)
+template<typename Fit>
+bool LFBSTreeT<Fit>::Cleanup(TKey key, SeekRecord& record)
 {
     std::atomic<NodeChild>* ancestorEdge = record.ancestorEdge;
     Node* successor = record.successor;
     Node* parent = record.parent;
-    std::atomic<NodeChild>* childAddr = (parent->key > key) ?
+    std::atomic<NodeChild>* childAddr = Fit::Greater(parent->key, key) ?
         &parent->left : &parent->right;
-    std::atomic<NodeChild>* siblingAddr = (parent->key > key) ?
+    std::atomic<NodeChild>* siblingAddr = Fit::Greater(parent->key, key) ?
         &parent->right : &parent->left;
 
     // if child isn't flagged, then sibling must be flagged
@@ -356,9 +596,11 @@ bool LFBSTree::Cleanup(TKey key, SeekRecord& record)
     NodeChild expected = siblingAddr->load();
     // another thread can concurrently set tag
     // ASSERT(expected.IsTagged() == false);
-    NodeChild desired = NodeChild(expected.IsFlagged(), true, expected.GetPtr());
+    NodeChild desired = NodeChild(expected.IsFlagged(), true,
+            expected.IsLeaf(), expected.GetPtr());
     while (!siblingAddr->compare_exchange_weak(expected, desired))
-        desired = NodeChild(expected.IsFlagged(), true, expected.GetPtr());
+        desired = NodeChild(expected.IsFlagged(), true,
+                expected.IsLeaf(), expected.GetPtr());
 
     ASSERT(expected.IsFlagged() == desired.IsFlagged());
     ASSERT(expected.GetPtr() == desired.GetPtr());
@@ -368,16 +610,21 @@ bool LFBSTree::Cleanup(TKey key, SeekRecord& record)
     // flag field must be copied to new edge
     // make sibling direct child of ancestor node
     NodeChild aExpected = NodeChild(successor);
-    NodeChild aDesired = NodeChild(desired.IsFlagged(), false, desired.GetPtr());
+    NodeChild aDesired = NodeChild(desired.IsFlagged(), false,
+            desired.IsLeaf(), desired.GetPtr());
     ASSERT(aExpected.GetPtr() != aDesired.GetPtr());
     if (ancestorEdge->compare_exchange_strong(aExpected, aDesired))
     {
         // successfully swapped sucessor subtree by sibling
         // now need to retire unreachable nodes
-        RetireSubtree(successor, aDesired.GetPtr());
+        RetireSubtree(NodeChild(successor), aDesired.GetPtr());
         return true;
     }
 
     return false;
 }
 
+// instantiate all fit policies, allocator uses the one selected by FIT_POLICY
+template class LFBSTreeT<BestFit>;
+template class LFBSTreeT<BucketFit<2> >;
+template class LFBSTreeT<AddressFit>;
@@ -17,6 +17,46 @@
 #include "defines.h"
 #include "log.h"
 
+// node reclamation schemes
+// epoch-based: cheap, but a thread stalled in the middle of an operation
+//  delays reclamation for all threads
+// hazard pointers: more expensive Seeks, but the number of retired nodes
+//  waiting for reuse is bounded per thread
+#define LFBSTREE_RECLAIM_EBR 0
+#define LFBSTREE_RECLAIM_HP 1
+
+#ifndef LFBSTREE_RECLAIM
+#define LFBSTREE_RECLAIM LFBSTREE_RECLAIM_EBR
+#endif
+
+// after losing a leaf to a concurrent removal, a thread starts its next
+//  RemoveNext operations at a random address among keys of the same size,
+//  to spread contending threads over different leaves
+// random leaves are colder in cache, so it only pays off with many threads
+//  allocating the same size on different cores, 0 disables it
+#ifndef LFBSTREE_SPREAD_OPS
+#define LFBSTREE_SPREAD_OPS 0
+#endif
+
+// the tree isn't balanced, and blocks are often inserted in address order
+//  (chunk splits, fresh chunks), which would degenerate equal-size keys
+//  into a list
+// instead, best fit orders equal-size keys by a hash of their address,
+//  so insertion order looks random and expected depth is logarithmic,
+//  as in a treap with address-derived priorities
+#ifndef LFBSTREE_HASH_ORDER
+#define LFBSTREE_HASH_ORDER 1
+#endif
+
+// fit policies, see FitPolicy structs below
+#define FIT_POLICY_BEST 0
+#define FIT_POLICY_BUCKET 1
+#define FIT_POLICY_ADDRESS 2
+
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_POLICY_BEST
+#endif
+
 // tree ordered by
 // 1. block size
 // 2. block address
@@ -49,47 +89,154 @@ public:
     }
 };
 
+// a fit policy defines the order of keys in the tree, and hence which
+//  block RemoveNext picks for a given request
+// Greater() must be a strict total order consistent with TKey::operator==
+// FitKey(size) returns the smallest key such that all keys >= it
+//  belong to blocks of at least `size` bytes
+
+// best fit, among blocks of the same size the lowest address or the
+//  lowest address hash, see LFBSTREE_HASH_ORDER
+struct BestFit
+{
+    // bijective mix (murmur3 finalizer), keeps nullptr as lowest
+    static size_t HashAddress(char* address)
+    {
+        size_t h = (size_t)address;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static bool Greater(TKey const& a, TKey const& b)
+    {
+#if LFBSTREE_HASH_ORDER
+        if (a.size != b.size)
+            return a.size > b.size;
+
+        return HashAddress(a.address) > HashAddress(b.address);
+#else
+        return a > b;
+#endif
+    }
+
+    static TKey FitKey(size_t size) { return TKey(size); }
+};
+
+// blocks are grouped in size buckets, 2^SubBits buckets per power of two
+// within a bucket, lowest address first
+// requests are rounded up to the next bucket, so any block in that
+//  bucket fits
+template<size_t SubBits>
+struct BucketFit
+{
+    static size_t Bucket(size_t size)
+    {
+        size_t lg = (sizeof(size_t) * 8 - 1) - __builtin_clzl(size | 1U);
+        if (lg < SubBits)
+            return size;
+
+        size_t shift = lg - SubBits;
+        return ((shift + 1) << SubBits) + (size >> shift) - (1U << SubBits);
+    }
+
+    static bool Greater(TKey const& a, TKey const& b)
+    {
+        size_t aBucket = Bucket(a.size);
+        size_t bBucket = Bucket(b.size);
+        if (aBucket != bBucket)
+            return aBucket > bBucket;
+
+        if (a.address != b.address)
+            return a.address > b.address;
+
+        // only dummy nodes share an address
+        return a.size > b.size;
+    }
+
+    static TKey FitKey(size_t size)
+    {
+        size_t lg = (sizeof(size_t) * 8 - 1) - __builtin_clzl(size | 1U);
+        if (lg < SubBits)
+            return TKey(size);
+
+        // round up to bucket granularity, smallest size in next bucket
+        size_t gran = (size_t)1U << (lg - SubBits);
+        return TKey((size + gran - 1) & ~(gran - 1));
+    }
+};
+
+// address-ordered first fit within power of two size classes
+// a true address-ordered first fit needs the largest block size of each
+//  subtree, which can't be kept up to date in a lock free tree
+typedef BucketFit<0> AddressFit;
+
+#if FIT_POLICY == FIT_POLICY_BEST
+typedef BestFit FitPolicy;
+#elif FIT_POLICY == FIT_POLICY_BUCKET
+typedef BucketFit<2> FitPolicy;
+#elif FIT_POLICY == FIT_POLICY_ADDRESS
+typedef AddressFit FitPolicy;
+#endif
+
 // helper structs
 struct Node;
 struct NodeChild;
 
 // node edge field
-// stores pointer to node and 2 boolean values, flagged and tagged
+// stores pointer to node and 3 boolean values, flagged, tagged and
+//  whether the node is a leaf
 #define NODE_CHILD_PTR_MASK (~((size_t)(1U << 3) - 1))
 #define NODE_CHILD_FLAG_SHIFT 0U
 #define NODE_CHILD_FLAG_MASK ((size_t)(1U << NODE_CHILD_FLAG_SHIFT))
 #define NODE_CHILD_TAG_SHIFT 1U
 #define NODE_CHILD_TAG_MASK ((size_t)(1U << NODE_CHILD_TAG_SHIFT))
+#define NODE_CHILD_LEAF_SHIFT 2U
+#define NODE_CHILD_LEAF_MASK ((size_t)(1U << NODE_CHILD_LEAF_SHIFT))
 
 struct NodeChild
 {
 public:
     NodeChild() = default;
-    NodeChild(Node* node) { Init(false, false, node); }
-    NodeChild(bool f, bool t, Node* node) { Init(f, t, node); }
+    NodeChild(Node* node) { Init(false, false, false, node); }
+    NodeChild(bool f, bool t, Node* node) { Init(f, t, false, node); }
+    NodeChild(bool f, bool t, bool l, Node* node) { Init(f, t, l, node); }
+
+    bool operator==(NodeChild const& other) const { return _ptr == other._ptr; }
+    bool operator!=(NodeChild const& other) const { return _ptr != other._ptr; }
 
     bool IsFlagged() const { return (bool)((size_t)_ptr & NODE_CHILD_FLAG_MASK); }
     bool IsTagged() const { return (bool)((size_t)_ptr & NODE_CHILD_TAG_MASK); }
+    bool IsLeaf() const { return (bool)((size_t)_ptr & NODE_CHILD_LEAF_MASK); }
     Node* GetPtr() const { return (Node*)((size_t)_ptr & NODE_CHILD_PTR_MASK); }
 
 private:
-    void Init(bool flagged, bool tagged, Node* ptr)
+    void Init(bool flagged, bool tagged, bool leaf, Node* ptr)
     {
         ASSERT(((size_t)ptr & ~NODE_CHILD_PTR_MASK) == 0);
         _ptr = (Node*)((size_t)ptr |
+                (size_t)leaf << NODE_CHILD_LEAF_SHIFT |
                 (size_t)tagged << NODE_CHILD_TAG_SHIFT |
                 (size_t)flagged << NODE_CHILD_FLAG_SHIFT);
 
         ASSERT(flagged == IsFlagged());
         ASSERT(tagged == IsTagged());
+        ASSERT(leaf == IsLeaf());
         ASSERT(ptr == GetPtr());
     }
 
 private:
-    // besides the pointer, 2 flags are stored in _ptr by bit-stealing
+    // besides the pointer, 3 flags are stored in _ptr by bit-stealing
     Node* _ptr = nullptr;
 };
 
+// internal tree node
+// tree leaves only hold a key, see LeafNode in lfbstree.cpp, but are also
+//  accessed through Node pointers, so key must be the first field and
+//  child edges must only be read from edges that aren't leaf edges
 struct Node
 {
     TKey key;
@@ -97,10 +244,18 @@ struct Node
     std::atomic<NodeChild> right;
 
 public:
-    Node() = default;
-    Node(TKey k) : key(k) { }
+    // nodes may be recycled, so child edges must always be reset
+    Node() : left(NodeChild()), right(NodeChild()) { }
+    Node(TKey k) : key(k), left(NodeChild()), right(NodeChild()) { }
 };
 
+// node memory is never returned to the OS, so nodes can also be used by
+//  other lock free structures that may read stale nodes
+// allocated nodes are owned by calling thread
+Node* AllocNode(TKey key);
+// node must not be reachable by any other thread
+void FreeNode(Node* node);
+
 struct SeekRecord
 {
     // ancestor -> successor edge
@@ -112,28 +267,46 @@ struct SeekRecord
     TKey lastLeftKey;
 };
 
-class LFBSTree
+template<typename Fit>
+class LFBSTreeT
 {
 public:
-    LFBSTree();
-    ~LFBSTree();
+    typedef Fit FitType;
+
+public:
+    LFBSTreeT();
+    ~LFBSTreeT();
 
     // available operations
     bool Insert(TKey key);
     bool Remove(TKey key);
     // removes smallest key from tree that is >= key
     // removed key stored in provided arg
+    // key should have no address, as one may be picked to spread contention
     bool RemoveNext(TKey& key);
 
+    // number of nodes retired but not yet reused
+    static size_t GetNumRetiredNodes();
+    // must be called on thread exit, hands off thread-local node state
+    static void ThreadFinalize();
+
 private:
     SeekRecord Seek(TKey key);
+    bool FlagLeaf(TKey key, SeekRecord& record);
+    bool RemoveRange(TKey& key, TKey const& limit);
     bool Cleanup(TKey key, SeekRecord& record);
 
 private:
     // default dummy nodes
     Node* _R;
     Node* _S;
+    // range of inserted addresses, to pick random start addresses
+    std::atomic<char*> _minAddress;
+    std::atomic<char*> _maxAddress;
 };
 
+// tree used by the allocator, fit policy is selected at build time
+typedef LFBSTreeT<FitPolicy> LFBSTree;
+
 #endif // __LFBSTREE
 
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#include <algorithm> // for min()
+#include <limits>
+#include "lfskiplist.h"
+#include "nodepool.h"
+#include "reclaim.h"
+#include "log.h"
+
+// removed nodes are reclaimed with epoch-based reclamation, see reclaim.h
+// Find doesn't publish hazards, so the list uses epochs regardless of
+//  LFBSTREE_RECLAIM
+
+// node state flags
+// a node can only be retired once it is unreachable, but its inserter may
+//  still link upper levels after it was removed, so the last of inserter
+//  and remover to be done with the node retires it
+#define SKIP_STATE_INSERTED ((size_t)1U)
+#define SKIP_STATE_REMOVED  ((size_t)2U)
+
+// node size classes, nodes up to SKIPLIST_LINE_LEVELS high take a cacheline
+#define SKIP_NUM_CLASSES 2
+
+// global variables
+static NodePool sSkipPools[SKIP_NUM_CLASSES] = {
+    { MagazineHead { nullptr, 0 }, CACHELINE },
+    { MagazineHead { nullptr, 0 }, 2 * CACHELINE },
+};
+
+// thread-local variables
+static __thread NodeCache sSkipCaches[SKIP_NUM_CLASSES];
+static __thread uint64_t sHeightSeed = 0;
+
+static inline SkipNode* EdgePtr(size_t edge)
+{
+    return (SkipNode*)(edge & ~SKIPLIST_MARK_MASK);
+}
+
+static inline bool IsMarked(size_t edge)
+{
+    return edge & SKIPLIST_MARK_MASK;
+}
+
+static inline size_t NodeClass(size_t height)
+{
+    return height > SKIPLIST_LINE_LEVELS;
+}
+
+static SkipNode* AllocSkipNode(TKey key, size_t height)
+{
+    size_t const cls = NodeClass(height);
+    char* slot = PoolAlloc(sSkipCaches[cls], sSkipPools[cls]);
+
+    // nodes may be recycled, so all used fields must be reset
+    // node memory may be smaller than SkipNode, only touch `height` edges
+    SkipNode* node = (SkipNode*)slot;
+    node->key = key;
+    node->state.store(0, std::memory_order_relaxed);
+    node->height = height;
+    for (size_t i = 0; i < height; ++i)
+        node->next[i].store(0, std::memory_order_relaxed);
+
+    return node;
+}
+
+// node must not be reachable by any other thread
+static void FreeSkipNode(SkipNode* node)
+{
+    size_t cls = NodeClass(node->height);
+    PoolFree(sSkipCaches[cls], sSkipPools[cls], (char*)node);
+}
+
+static void RecycleSkipNode(void* node)
+{
+    FreeSkipNode((SkipNode*)node);
+}
+
+static size_t RandomHeight()
+{
+    // xorshift64
+    uint64_t x = sHeightSeed ? sHeightSeed : (uint64_t)&x | 1U;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    sHeightSeed = x;
+
+    size_t height = 1 + __builtin_ctzll(x | (1ULL << 63)) / SKIPLIST_LEVEL_SHIFT;
+    return std::min(height, (size_t)SKIPLIST_MAX_LEVEL);
+}
+
+template<typename Fit>
+size_t LFSkipListT<Fit>::GetNumRetiredNodes()
+{
+    return GetNumRetiredEntries();
+}
+
+template<typename Fit>
+void LFSkipListT<Fit>::ThreadFinalize()
+{
+    // hand off retired nodes, then free node lists, as handing off may
+    //  recycle nodes
+    ReclaimThreadFinalize();
+    for (size_t cls = 0; cls < SKIP_NUM_CLASSES; ++cls)
+        PoolFlush(sSkipCaches[cls], sSkipPools[cls]);
+}
+
+template<typename Fit>
+LFSkipListT<Fit>::LFSkipListT()
+{
+    SetRecycleFunc(RECLAIM_SKIP_NODE, RecycleSkipNode);
+
+    // head is never removed nor compared against
+    _head = AllocSkipNode(TKey(), SKIPLIST_MAX_LEVEL);
+}
+
+template<typename Fit>
+LFSkipListT<Fit>::~LFSkipListT() { }
+
+template<typename Fit>
+bool LFSkipListT<Fit>::Find(TKey key, SkipNode** preds, SkipNode** succs)
+{
+    // finds, at each level, the last node < key and the first node >= key
+    // unlinks marked nodes on the way
+    // returns true if a node with key is in list
+    while (true)
+    {
+        SkipNode* pred = _head;
+        bool valid = true;
+        for (size_t l = SKIPLIST_MAX_LEVEL; valid && l-- > 0; )
+        {
+            SkipNode* curr = EdgePtr(pred->next[l].load());
+            while (curr)
+            {
+                size_t succ = curr->next[l].load();
+                if (IsMarked(succ))
+                {
+                    // curr is removed, unlink it at this level
+                    // fails if pred is also removed or changed, start over
+                    size_t expected = (size_t)curr;
+                    if (!pred->next[l].compare_exchange_strong(expected,
+                                (size_t)EdgePtr(succ)))
+                    {
+                        valid = false;
+                        break;
+                    }
+
+                    curr = EdgePtr(succ);
+                    continue;
+                }
+
+                if (!Fit::Greater(key, curr->key))
+                    break;
+
+                pred = curr;
+                curr = EdgePtr(succ);
+            }
+
+            preds[l] = pred;
+            succs[l] = curr;
+        }
+
+        if (!valid)
+            continue;
+
+        return succs[0] && succs[0]->key == key;
+    }
+}
+
+template<typename Fit>
+bool LFSkipListT<Fit>::Insert(TKey key)
+{
+    EpochGuard guard;
+    SkipNode* preds[SKIPLIST_MAX_LEVEL];
+    SkipNode* succs[SKIPLIST_MAX_LEVEL];
+    // new node is only allocated once, and reused if CAS fails
+    SkipNode* node = nullptr;
+    while (true)
+    {
+        // key already in list
+        if (Find(key, preds, succs))
+        {
+            ASSERT(false);
+            if (node)
+                FreeSkipNode(node);
+
+            return false;
+        }
+
+        if (node == nullptr)
+            node = AllocSkipNode(key, RandomHeight());
+
+        for (size_t l = 0; l < node->height; ++l)
+            node->next[l].store((size_t)succs[l], std::memory_order_relaxed);
+
+        // node is in list once linked at the bottom level
+        size_t expected = (size_t)succs[0];
+        if (preds[0]->next[0].compare_exchange_strong(expected, (size_t)node))
+            break;
+    }
+
+    // link upper levels, stop if node is removed meanwhile
+    bool removed = false;
+    for (size_t l = 1; l < node->height && !removed; ++l)
+    {
+        while (true)
+        {
+            size_t expected = (size_t)succs[l];
+            if (preds[l]->next[l].compare_exchange_strong(expected, (size_t)node))
+                break;
+
+            // pred changed, find new neighbours
+            Find(key, preds, succs);
+            size_t next = node->next[l].load();
+            if (IsMarked(next) || !node->next[l].compare_exchange_strong(
+                        next, (size_t)succs[l]))
+            {
+                // marked, by a remover
+                removed = true;
+                break;
+            }
+        }
+    }
+
+    // remover might have missed a level linked after it unlinked node
+    if (IsMarked(node->next[0].load()))
+        Find(key, preds, succs);
+
+    FinishNode(node, SKIP_STATE_INSERTED);
+    return true;
+}
+
+template<typename Fit>
+bool LFSkipListT<Fit>::Remove(TKey key)
+{
+    EpochGuard guard;
+    SkipNode* preds[SKIPLIST_MAX_LEVEL];
+    SkipNode* succs[SKIPLIST_MAX_LEVEL];
+    while (Find(key, preds, succs))
+    {
+        if (RemoveNode(succs[0]))
+            return true;
+    }
+
+    return false;
+}
+
+template<typename Fit>
+bool LFSkipListT<Fit>::RemoveNext(TKey& key)
+{
+    EpochGuard guard;
+    SkipNode* preds[SKIPLIST_MAX_LEVEL];
+    SkipNode* succs[SKIPLIST_MAX_LEVEL];
+    while (true)
+    {
+        // bottom level successor is the smallest key >= key
+        Find(key, preds, succs);
+        SkipNode* node = succs[0];
+        if (node == nullptr)
+            return false;
+
+        TKey nodeKey = node->key;
+        if (RemoveNode(node))
+        {
+            key = nodeKey;
+            return true;
+        }
+
+        // lost node to another thread, Find will unlink it
+    }
+}
+
+template<typename Fit>
+bool LFSkipListT<Fit>::RemoveNode(SkipNode* node)
+{
+    // mark upper levels first, top down, so the inserter stops linking
+    for (size_t l = node->height; l-- > 1; )
+    {
+        size_t next = node->next[l].load();
+        while (!IsMarked(next) &&
+            !node->next[l].compare_exchange_weak(next, next | SKIPLIST_MARK_MASK));
+    }
+
+    // marking bottom level removes node, only one thread succeeds
+    size_t next = node->next[0].load();
+    while (true)
+    {
+        if (IsMarked(next))
+            return false;
+
+        if (node->next[0].compare_exchange_weak(next, next | SKIPLIST_MARK_MASK))
+            break;
+    }
+
+    // unlink node at all levels
+    SkipNode* preds[SKIPLIST_MAX_LEVEL];
+    SkipNode* succs[SKIPLIST_MAX_LEVEL];
+    Find(node->key, preds, succs);
+    FinishNode(node, SKIP_STATE_REMOVED);
+    return true;
+}
+
+template<typename Fit>
+void LFSkipListT<Fit>::FinishNode(SkipNode* node, size_t flag)
+{
+    // last of inserter and remover retires node
+    size_t state = node->state.fetch_or(flag);
+    if (state & ~flag)
+        RetireEpoch(node, RECLAIM_SKIP_NODE);
+}
+
+// instantiate all fit policies, allocator uses the one selected by FIT_POLICY
+template class LFSkipListT<BestFit>;
+template class LFSkipListT<BucketFit<2> >;
+template class LFSkipListT<AddressFit>;
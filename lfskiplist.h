@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#ifndef __LFSKIPLIST
+#define __LFSKIPLIST
+
+// implementation of a lock free skip list
+//  based on the lock free skip list in "The Art of Multiprocessor
+//  Programming" by Maurice Herlihy and Nir Shavit, with physical deletion
+//  as in "Practical lock-freedom" by Keir Fraser
+// alternative block index to LFBSTree, same interface and fit policies
+// nodes are cacheline sized, the key and the lowest levels share a line,
+//  so each step of a search touches a single line
+// removed nodes are reclaimed with the epoch-based scheme in reclaim.h,
+//  independent of LFBSTREE_RECLAIM, and nodes come from the node pools
+//  in nodepool.h
+
+#include <atomic>
+
+#include "defines.h"
+#include "log.h"
+#include "lfbstree.h" // for TKey and fit policies
+
+// max node height
+#define SKIPLIST_MAX_LEVEL 12
+// nodes up to this height fit in a cacheline, taller nodes take two
+#define SKIPLIST_LINE_LEVELS 4
+// a node reaches each next level with probability 1 / 2^SKIPLIST_LEVEL_SHIFT
+#define SKIPLIST_LEVEL_SHIFT 2
+
+// next edge field
+// lowest bit marks node as removed at that level
+#define SKIPLIST_MARK_MASK ((size_t)1U)
+
+struct SkipNode
+{
+    TKey key;
+    // inserter/remover handshake, see LFSkipListT::FinishNode
+    std::atomic<size_t> state;
+    size_t height;
+    // only the first `height` edges are allocated
+    std::atomic<size_t> next[SKIPLIST_MAX_LEVEL];
+};
+
+STATIC_ASSERT(offsetof(SkipNode, next[SKIPLIST_LINE_LEVELS]) == CACHELINE,
+        "Invalid SkipNode layout");
+STATIC_ASSERT(sizeof(SkipNode) <= 2 * CACHELINE, "Invalid SkipNode size");
+
+template<typename Fit>
+class LFSkipListT
+{
+public:
+    typedef Fit FitType;
+
+public:
+    LFSkipListT();
+    ~LFSkipListT();
+
+    // available operations
+    bool Insert(TKey key);
+    bool Remove(TKey key);
+    // removes smallest key from list that is >= key
+    // removed key stored in provided arg
+    bool RemoveNext(TKey& key);
+
+    // number of nodes retired but not yet reused
+    static size_t GetNumRetiredNodes();
+    // must be called on thread exit, hands off thread-local node state
+    static void ThreadFinalize();
+
+private:
+    bool Find(TKey key, SkipNode** preds, SkipNode** succs);
+    bool RemoveNode(SkipNode* node);
+    void FinishNode(SkipNode* node, size_t flag);
+
+private:
+    // head sentinel, with max height and a key below any block
+    SkipNode* _head;
+};
+
+// list used by the allocator when selected, see BLOCK_INDEX in internal.h
+typedef LFSkipListT<FitPolicy> LFSkipList;
+
+#endif // __LFSKIPLIST
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#include "nodepool.h"
+#include "pages.h"
+
+static void PushMagazine(NodePool& pool, char* magazine)
+{
+    MagazineHead oldHead = pool.magazines.load();
+    MagazineHead newHead;
+    do
+    {
+        *(char**)(magazine + sizeof(char*)) = oldHead.magazine;
+        newHead.magazine = magazine;
+        newHead.tag = oldHead.tag + 1;
+    }
+    while (!pool.magazines.compare_exchange_weak(oldHead, newHead));
+}
+
+static char* PopMagazine(NodePool& pool)
+{
+    MagazineHead oldHead = pool.magazines.load();
+    MagazineHead newHead;
+    do
+    {
+        if (oldHead.magazine == nullptr)
+            return nullptr;
+
+        // magazine may be concurrently popped and its nodes reused
+        // tag ensures CAS fails if that happens
+        newHead.magazine = *(char**)(oldHead.magazine + sizeof(char*));
+        newHead.tag = oldHead.tag + 1;
+    }
+    while (!pool.magazines.compare_exchange_weak(oldHead, newHead));
+
+    return oldHead.magazine;
+}
+
+// carves up a new page block into magazines, keeps the first one
+static char* CarveMagazines(NodePool& pool)
+{
+    char* buffer = (char*)PageAlloc(NODE_POOL_BLOCK_SIZE);
+    if (UNLIKELY(buffer == nullptr))
+        abort();
+
+    size_t const magazineSize = pool.nodeSize * NODE_MAGAZINE_SIZE;
+    size_t const numMagazines = NODE_POOL_BLOCK_SIZE / magazineSize;
+    for (size_t m = numMagazines; m-- > 0; )
+    {
+        char* magazine = buffer + m * magazineSize;
+        for (size_t i = 0; i < NODE_MAGAZINE_SIZE - 1; ++i)
+        {
+            char* node = magazine + i * pool.nodeSize;
+            *(char**)node = node + pool.nodeSize;
+        }
+
+        *(char**)(magazine + magazineSize - pool.nodeSize) = nullptr;
+        if (m > 0)
+            PushMagazine(pool, magazine);
+    }
+
+    return buffer;
+}
+
+char* PoolRefill(NodeCache& cache, NodePool& pool)
+{
+    ASSERT(cache.head == nullptr);
+    char* magazine = PopMagazine(pool);
+    if (magazine == nullptr)
+        magazine = CarveMagazines(pool);
+
+    cache.head = magazine;
+    cache.count = NODE_MAGAZINE_SIZE;
+    return magazine;
+}
+
+void PoolSpill(NodeCache& cache, NodePool& pool)
+{
+    // return a full magazine to the pool, keep the rest
+    // count may only overestimate the list by less than a magazine, so
+    //  list holds more than a magazine
+    char* magazine = cache.head;
+    char* tail = magazine;
+    for (size_t i = 1; i < NODE_MAGAZINE_SIZE; ++i)
+        tail = *(char**)tail;
+
+    cache.head = *(char**)tail;
+    *(char**)tail = nullptr;
+    cache.count -= NODE_MAGAZINE_SIZE;
+    PushMagazine(pool, magazine);
+}
+
+void PoolFlush(NodeCache& cache, NodePool& pool)
+{
+    while (cache.head)
+    {
+        char* magazine = cache.head;
+        char* tail = magazine;
+        for (size_t i = 1; i < NODE_MAGAZINE_SIZE && *(char**)tail; ++i)
+            tail = *(char**)tail;
+
+        cache.head = *(char**)tail;
+        *(char**)tail = nullptr;
+        PushMagazine(pool, magazine);
+    }
+
+    cache.count = 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#ifndef __NODEPOOL_H
+#define __NODEPOOL_H
+
+// fixed-size node pools, shared by the block indexes
+// free nodes are cached in per-thread lists, and move between threads in
+//  magazines through a global lock free stack, so node memory follows the
+//  number of live nodes rather than the number of threads
+// a thread caches at most 2 magazines worth of nodes
+
+#include <atomic>
+
+#include "defines.h"
+#include "log.h"
+
+#define NODE_MAGAZINE_SIZE 64
+// size of page blocks to carve up magazines from
+// blocks are shared by all threads, so they can be hugepage sized
+#define NODE_POOL_BLOCK_SIZE HUGEPAGE
+
+// magazines are free node lists, linked through their heads' second word
+// head is tagged to prevent ABA issues, magazine heads may be concurrently
+//  popped and reused, but node memory is never returned to the OS
+struct MagazineHead
+{
+    char* magazine;
+    size_t tag;
+};
+
+// nodes are aligned to the largest power of 2 dividing nodeSize
+struct NodePool
+{
+    std::atomic<MagazineHead> magazines;
+    size_t const nodeSize;
+};
+
+// per-thread free node list, nodes linked through their first word
+// count is exact, except for magazines left by exiting threads, which may
+//  be partial but are counted as full
+struct NodeCache
+{
+    char* head;
+    size_t count;
+};
+
+// slow paths, take or return a whole magazine
+char* PoolRefill(NodeCache& cache, NodePool& pool);
+void PoolSpill(NodeCache& cache, NodePool& pool);
+// hands off a thread-local free list to other threads
+void PoolFlush(NodeCache& cache, NodePool& pool);
+
+CMALLOC_INLINE char* PoolAlloc(NodeCache& cache, NodePool& pool)
+{
+    if (UNLIKELY(cache.head == nullptr))
+        PoolRefill(cache, pool);
+
+    char* node = cache.head;
+    cache.head = *(char**)node;
+    if (cache.count > 0)
+        --cache.count;
+
+    return node;
+}
+
+// node must not be reachable by any other thread
+CMALLOC_INLINE void PoolFree(NodeCache& cache, NodePool& pool, char* node)
+{
+    *(char**)node = cache.head;
+    cache.head = node;
+    if (UNLIKELY(++cache.count >= 2 * NODE_MAGAZINE_SIZE))
+        PoolSpill(cache, pool);
+}
+
+#endif // __NODEPOOL_H
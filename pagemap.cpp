@@ -9,6 +9,7 @@
 
 PageMap sPageMap;
 
+#if PAGEMAP_IMPL == PAGEMAP_ARRAY
 void PageMap::Init()
 {
     // pages will necessarily be given by the OS
@@ -17,3 +18,48 @@ void PageMap::Init()
     _pagemap = (std::atomic<PageInfo>*)PageAllocOvercommit(PM_SZ);
     ASSERT(_pagemap);
 }
+
+#else
+void PageMap::Init()
+{
+    // root is statically allocated, nodes are allocated on demand
+}
+
+std::atomic<PageInfo>* PageMap::AllocLeaf(size_t key)
+{
+    size_t l1 = key >> (PM_L2_BITS + PM_L3_BITS);
+    size_t l2 = (key >> PM_L3_BITS) & ((1ULL << PM_L2_BITS) - 1);
+
+    // install middle node if needed
+    // nodes are given by the OS, so they're already zero'd
+    Leaf* mid = _root[l1].load(std::memory_order_acquire);
+    if (mid == nullptr)
+    {
+        Leaf* newMid = (Leaf*)PageAlloc(PM_L2_SZ);
+        if (UNLIKELY(newMid == nullptr))
+            abort();
+
+        if (_root[l1].compare_exchange_strong(mid, newMid))
+            mid = newMid;
+        else
+            PageFree(newMid, PM_L2_SZ); // lost race, use winner's node
+    }
+
+    // then leaf
+    std::atomic<PageInfo>* leaf = mid[l2].load(std::memory_order_acquire);
+    if (leaf == nullptr)
+    {
+        std::atomic<PageInfo>* newLeaf =
+            (std::atomic<PageInfo>*)PageAlloc(PM_L3_SZ);
+        if (UNLIKELY(newLeaf == nullptr))
+            abort();
+
+        if (mid[l2].compare_exchange_strong(leaf, newLeaf))
+            leaf = newLeaf;
+        else
+            PageFree(newLeaf, PM_L3_SZ);
+    }
+
+    return leaf;
+}
+#endif
@@ -11,11 +11,16 @@
 #include "defines.h"
 #include "log.h"
 
-// assuming x86-64, for now
-// which uses 48 bits for addressing (e.g high 16 bits ignored)
+// number of significant address bits
+// x86-64 uses 48 bits with 4-level paging, 57 bits with 5-level paging
+// addresses at or above 2^PM_ADDR_BITS are never handed out by PageAlloc
+#ifndef PM_ADDR_BITS
+#define PM_ADDR_BITS 48
+#endif
+
 // can ignore the bottom 12 bits (lg of page)
 // insignificant high bits
-#define PM_NHS 12
+#define PM_NHS (64 - PM_ADDR_BITS)
 // insignificant low bits
 #define PM_NLS LG_PAGE
 // significant middle bits
@@ -27,11 +32,59 @@
 #define PM_KEY_MASK ((1ULL << PM_SB) - 1)
 
 // associates metadata to each allocator page
-// implemented with a static array, but can also be implemented
-//  with a multi-level radix tree
+// implemented either with a static array, which reserves PM_SZ bytes of
+//  virtual memory upfront, or with a lock-free 3-level radix tree, which
+//  only allocates nodes for address ranges that are actually used
+#define PAGEMAP_ARRAY 0
+#define PAGEMAP_RADIX 1
+
+// an array is only practical for up to 48-bit address spaces
+#ifndef PAGEMAP_IMPL
+#if PM_ADDR_BITS > 48
+#define PAGEMAP_IMPL PAGEMAP_RADIX
+#else
+#define PAGEMAP_IMPL PAGEMAP_ARRAY
+#endif
+#endif
+
+#if PAGEMAP_IMPL == PAGEMAP_ARRAY && PM_ADDR_BITS > 48
+#error "Array page map requires PM_ADDR_BITS <= 48"
+#endif
+
+// radix tree levels, the significant bits are split among them
+// leaves cover 2^PM_L3_BITS pages, and are allocated on first update
+// e.g 12/12/12 bits for 48-bit addresses, 17/16/12 for 57-bit addresses
+#define PM_L3_BITS 12
+#define PM_L2_BITS ((PM_SB - PM_L3_BITS) / 2)
+#define PM_L1_BITS (PM_SB - PM_L2_BITS - PM_L3_BITS)
+#define PM_L3_SZ ((1ULL << PM_L3_BITS) * sizeof(PageInfo))
+#define PM_L2_SZ ((1ULL << PM_L2_BITS) * sizeof(void*))
 
 #define SC_MASK ((1ULL << 6) - 1)
 
+// the lowest bits of a PageInfo word hold flags
+// block sizes are page multiples and slab descriptors are cacheline
+//  aligned, so these bits are otherwise unused
+#define PI_FLAGS_MASK ((int64_t)CACHELINE_MASK)
+// pages that belong to a slab store a pointer to the slab descriptor
+//  instead of a block size
+#define PI_SLAB_FLAG ((int64_t)1 << 0)
+// set on the start page of free blocks whose pages were purged
+#define PI_CLEAN_FLAG ((int64_t)1 << 1)
+// first and last page of a chunk obtained from the OS
+// set for as long as the chunk is mapped, and must be preserved
+//  by all other updates to those pages
+#define PI_CHUNK_START_FLAG ((int64_t)1 << 2)
+#define PI_CHUNK_END_FLAG ((int64_t)1 << 3)
+// set on every page of a chunk backed by hugetlb pages
+// such chunks are never purged nor unmapped
+#define PI_HUGETLB_FLAG ((int64_t)1 << 4)
+// set on the first page of a chunk mapped for a single direct block
+// such chunks are unmapped as soon as their block is freed
+#define PI_DIRECT_FLAG ((int64_t)1 << 5)
+#define PI_CHUNK_FLAGS \
+    (PI_CHUNK_START_FLAG | PI_CHUNK_END_FLAG | PI_HUGETLB_FLAG | PI_DIRECT_FLAG)
+
 // contains metadata per page
 // *has* to be the size of a single word
 struct PageInfo
@@ -40,11 +93,24 @@ struct PageInfo
     // if 0, page is neither start nor end of block
     // if > 0, page is start of block
     // if < 0, page is end of block
+    // flags are stored in the lowest bits, see PI_FLAGS_MASK
+    // if PI_SLAB_FLAG is set, page belongs to a slab (see IsSlab)
     int64_t size;
 
 public:
     PageInfo() = default;
     PageInfo(int64_t s) : size(s) { }
+
+    // block size, without flags
+    int64_t GetSize() const { return size & ~PI_FLAGS_MASK; }
+    int64_t GetFlags() const { return size & PI_FLAGS_MASK; }
+
+    bool IsSlab() const { return size & PI_SLAB_FLAG; }
+    bool IsClean() const { return size & PI_CLEAN_FLAG; }
+    bool IsChunkStart() const { return size & PI_CHUNK_START_FLAG; }
+    bool IsChunkEnd() const { return size & PI_CHUNK_END_FLAG; }
+    bool IsHugeTLB() const { return size & PI_HUGETLB_FLAG; }
+    bool IsDirect() const { return size & PI_DIRECT_FLAG; }
 };
 
 #define PM_SZ ((1ULL << PM_SB) * sizeof(PageInfo))
@@ -65,18 +131,33 @@ public:
 
 private:
     size_t AddrToKey(char* ptr) const;
+#if PAGEMAP_IMPL == PAGEMAP_RADIX
+    // returns entry for key, or nullptr if its leaf doesn't exist
+    //  and alloc is false
+    std::atomic<PageInfo>* GetEntry(size_t key, bool alloc);
+    std::atomic<PageInfo>* AllocLeaf(size_t key);
+#endif
 
 private:
+#if PAGEMAP_IMPL == PAGEMAP_ARRAY
     // array based impl
     std::atomic<PageInfo>* _pagemap = { nullptr };
+#else
+    // radix tree based impl
+    typedef std::atomic<std::atomic<PageInfo>*> Leaf;
+    std::atomic<Leaf*> _root[1ULL << PM_L1_BITS];
+#endif
 };
 
 inline size_t PageMap::AddrToKey(char* ptr) const
 {
+    // higher addresses would alias lower pages
+    ASSERT(((size_t)ptr >> PM_ADDR_BITS) == 0);
     size_t key = ((size_t)ptr >> PM_KEY_SHIFT) & PM_KEY_MASK;
     return key;
 }
 
+#if PAGEMAP_IMPL == PAGEMAP_ARRAY
 inline PageInfo PageMap::GetPageInfo(char* ptr)
 {
     size_t key = AddrToKey(ptr);
@@ -95,7 +176,56 @@ inline bool PageMap::UpdatePageInfo(char* ptr, PageInfo expected, PageInfo desir
     return _pagemap[key].compare_exchange_strong(expected, desired);
 }
 
+#else
+inline std::atomic<PageInfo>* PageMap::GetEntry(size_t key, bool alloc)
+{
+    size_t l1 = key >> (PM_L2_BITS + PM_L3_BITS);
+    size_t l2 = (key >> PM_L3_BITS) & ((1ULL << PM_L2_BITS) - 1);
+    size_t l3 = key & ((1ULL << PM_L3_BITS) - 1);
+
+    Leaf* mid = _root[l1].load(std::memory_order_acquire);
+    std::atomic<PageInfo>* leaf = LIKELY(mid != nullptr) ?
+        mid[l2].load(std::memory_order_acquire) : nullptr;
+    if (UNLIKELY(leaf == nullptr))
+    {
+        if (!alloc)
+            return nullptr;
+
+        leaf = AllocLeaf(key);
+    }
+
+    return &leaf[l3];
+}
+
+inline PageInfo PageMap::GetPageInfo(char* ptr)
+{
+    std::atomic<PageInfo>* entry = GetEntry(AddrToKey(ptr), false);
+    // pages without a leaf were never updated
+    return entry ? entry->load() : PageInfo(0);
+}
+
+inline void PageMap::SetPageInfo(char* ptr, PageInfo info)
+{
+    std::atomic<PageInfo>* entry = GetEntry(AddrToKey(ptr), true);
+    entry->store(info);
+}
+
+inline bool PageMap::UpdatePageInfo(char* ptr, PageInfo expected, PageInfo desired)
+{
+    std::atomic<PageInfo>* entry = GetEntry(AddrToKey(ptr), true);
+    return entry->compare_exchange_strong(expected, desired);
+}
+#endif
+
 extern PageMap sPageMap;
 
+// true if all of [ptr, ptr + size) is below 2^PM_ADDR_BITS, and so can
+//  be tracked by the page map
+static inline bool InAddressRange(void* ptr, size_t size)
+{
+    size_t last = (size_t)ptr + size - 1;
+    return last >= (size_t)ptr && (last >> PM_ADDR_BITS) == 0;
+}
+
 #endif // __PAGEMAP_H
 
@@ -6,18 +6,71 @@
 #include <sys/mman.h>
 
 #include "pages.h"
+#include "pagemap.h"
 #include "log.h"
 
+// page map can't track pages at or above 2^PM_ADDR_BITS
+static inline void* CheckAddressRange(void* ptr, size_t size)
+{
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    if (UNLIKELY(!InAddressRange(ptr, size)))
+    {
+        munmap(ptr, size);
+        return nullptr;
+    }
+
+    return ptr;
+}
+
 void* PageAlloc(size_t size)
 {
     ASSERT((size & PAGE_MASK) == 0);
 
     void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
            MAP_PRIVATE | MAP_ANON, -1, 0);
+    return CheckAddressRange(ptr, size);
+}
+
+void* PageAllocChunk(size_t size)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+
+    // over-map by HUGEPAGE - PAGE and trim to get an aligned chunk
+    size_t mapSize = size + HUGEPAGE - PAGE;
+    char* ptr = (char*)mmap(nullptr, mapSize, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANON, -1, 0);
     if (ptr == MAP_FAILED)
-        ptr = nullptr;
- 
-    return ptr;
+        return nullptr;
+
+    char* chunk = ALIGN_ADDR(ptr, HUGEPAGE);
+    size_t head = chunk - ptr;
+    size_t tail = mapSize - head - size;
+    if (head > 0)
+        munmap(ptr, head);
+
+    if (tail > 0)
+        munmap(chunk + size, tail);
+
+#if PAGES_THP
+    // only a hint, failure is harmless (e.g THP disabled)
+    madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+    return CheckAddressRange(chunk, size);
+}
+
+void* PageAllocHugeTLB(size_t size, size_t hugeSize)
+{
+    ASSERT((hugeSize & (hugeSize - 1)) == 0);
+    ASSERT((size & (hugeSize - 1)) == 0);
+
+    // huge page size is encoded as log2 in the MAP_HUGE_SHIFT bits
+    int lgHugeSize = __builtin_ctzl(hugeSize);
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANON | MAP_HUGETLB |
+           (lgHugeSize << MAP_HUGE_SHIFT), -1, 0);
+    return CheckAddressRange(ptr, size);
 }
 
 void* PageAllocOvercommit(size_t size)
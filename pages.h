@@ -9,12 +9,26 @@
 #include <cinttypes>
 #include "defines.h"
 
+// transparent huge pages
+// if PAGES_THP = 1, chunks obtained with PageAllocChunk are advised
+//  with MADV_HUGEPAGE, so the OS can back them with huge pages
+#ifndef PAGES_THP
+#define PAGES_THP 1
+#endif
+
 // return page address for page containing a
 #define PAGE_ADDR2BASE(a) \
     ((void*)((uintptr)(a) & ~PAGE_MASK))
 
 // returns a set of continous pages, totaling to size bytes
 void* PageAlloc(size_t size);
+// returns a HUGEPAGE-aligned chunk to be managed by the block allocator,
+//  totaling to size bytes
+void* PageAllocChunk(size_t size);
+// returns a chunk backed by hugetlb pages of hugeSize bytes
+// size must be a multiple of hugeSize
+// returns nullptr if the hugetlb pool can't satisfy the request
+void* PageAllocHugeTLB(size_t size, size_t hugeSize);
 // explictely allow overcommiting
 // used for array-based page map
 void* PageAllocOvercommit(size_t size);
@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#include <algorithm> // for sort()
+#include <new>
+#include "reclaim.h"
+#include "pages.h"
+
+// epoch-based reclamation
+// number of limbo lists per thread, indexed by epoch
+#define EPOCH_NUM_LIMBO 3
+// attempt to advance global epoch after this many retired entries
+#define EPOCH_ADVANCE_FREQ 64
+#define EPOCH_ACTIVE_MASK ((size_t)1U)
+
+// hazard pointer reclamation
+// a thread scans hazards once it holds this many retired entries
+//  at least HP_SCAN_MIN, and HP_SCAN_FACTOR times the number of hazards
+// a scan can keep at most as many entries as there are hazards, so at most
+//  max(HP_SCAN_MIN, HP_SCAN_FACTOR * RECLAIM_NUM_HAZARDS * threads) entries
+//  are ever waiting for reuse per thread
+#define HP_SCAN_MIN     64
+#define HP_SCAN_FACTOR  2
+
+// page-sized container of retired entries
+// retired entries can't be linked intrusively, as concurrent operations
+//  may still be reading them
+struct LimboBag
+{
+    LimboBag* next;
+    // epoch in which contained entries were retired
+    size_t epoch;
+    size_t count;
+    void* entries[(PAGE - 3 * sizeof(size_t)) / sizeof(void*)];
+};
+
+STATIC_ASSERT(sizeof(LimboBag) <= PAGE, "Invalid LimboBag size");
+
+#define LIMBO_BAG_CAPACITY (sizeof(LimboBag::entries) / sizeof(void*))
+
+// global variables
+static std::atomic<ThreadRecord*> sThreadRecords(nullptr);
+static std::atomic<size_t> sNumThreadRecords(0);
+static std::atomic<size_t> sNumRetiredEntries(0);
+static std::atomic<size_t> sEpoch(0);
+// bags left behind by exited threads, one list per scheme
+static std::atomic<LimboBag*> sOrphanEpochBags(nullptr);
+static std::atomic<LimboBag*> sOrphanHazardBags(nullptr);
+static RecycleFunc sRecycleFuncs[RECLAIM_NUM_KINDS];
+
+// thread-local variables
+__thread ThreadRecord* sReclaimRecord CMALLOC_TLS_INIT_EXEC = nullptr;
+static __thread size_t sEpochDepth = 0;
+static __thread size_t sHazardDepth = 0;
+static __thread LimboBag* sSpareBags = nullptr;
+static __thread LimboBag* sLimbo[EPOCH_NUM_LIMBO];
+static __thread size_t sLimboEpoch[EPOCH_NUM_LIMBO];
+static __thread size_t sNumRetires = 0;
+static __thread LimboBag* sRetired = nullptr;
+static __thread size_t sNumRetired = 0;
+// snapshot of all published hazards, used during scans
+static __thread void** sHazards = nullptr;
+static __thread size_t sHazardsSize = 0;
+
+static ThreadRecord* AcquireThreadRecord()
+{
+    sNumThreadRecords.fetch_add(1);
+
+    // try to reuse a record released by an exited thread
+    for (ThreadRecord* rec = sThreadRecords.load(); rec; rec = rec->next)
+    {
+        bool expected = false;
+        if (!rec->inUse.load() &&
+            rec->inUse.compare_exchange_strong(expected, true))
+            return rec;
+    }
+
+    // carve up a new page into records, keep first one
+    char* buffer = (char*)PageAlloc(PAGE);
+    if (UNLIKELY(buffer == nullptr))
+        abort();
+
+    // pages are 0-filled, so records start inactive
+    size_t const numRecords = PAGE / sizeof(ThreadRecord);
+    ThreadRecord* records = (ThreadRecord*)buffer;
+    for (size_t i = 0; i < numRecords; ++i)
+    {
+        new (&records[i]) ThreadRecord();
+        records[i].inUse.store(i == 0);
+        records[i].next = (i + 1 < numRecords) ? &records[i + 1] : nullptr;
+    }
+
+    ThreadRecord* last = &records[numRecords - 1];
+    ThreadRecord* head = sThreadRecords.load();
+    do
+        last->next = head;
+    while (!sThreadRecords.compare_exchange_weak(head, records));
+
+    return records;
+}
+
+static void ReleaseThreadRecord()
+{
+    if (sReclaimRecord == nullptr)
+        return;
+
+    sReclaimRecord->inUse.store(false);
+    sReclaimRecord = nullptr;
+    sNumThreadRecords.fetch_sub(1);
+}
+
+static LimboBag* AllocLimboBag()
+{
+    LimboBag* bag = sSpareBags;
+    if (bag)
+        sSpareBags = bag->next;
+    else
+    {
+        bag = (LimboBag*)PageAlloc(PAGE);
+        if (UNLIKELY(bag == nullptr))
+            abort();
+    }
+
+    bag->next = nullptr;
+    bag->count = 0;
+    return bag;
+}
+
+static void PushOrphanBag(std::atomic<LimboBag*>& orphans, LimboBag* bag)
+{
+    LimboBag* head = orphans.load();
+    do
+        bag->next = head;
+    while (!orphans.compare_exchange_weak(head, bag));
+}
+
+// adds entry to bag list, with a new bag in front if first one is full
+static void PushEntry(LimboBag*& bags, void* entry, size_t epoch)
+{
+    LimboBag* bag = bags;
+    if (bag == nullptr || bag->count == LIMBO_BAG_CAPACITY)
+    {
+        LimboBag* newBag = AllocLimboBag();
+        newBag->next = bag;
+        newBag->epoch = epoch;
+        bags = newBag;
+        bag = newBag;
+    }
+
+    bag->entries[bag->count++] = entry;
+}
+
+static inline void* EntryPtr(void* entry)
+{
+    return (void*)((size_t)entry & ~RECLAIM_KIND_MASK);
+}
+
+static void RecycleEntry(void* entry)
+{
+    size_t kind = (size_t)entry & RECLAIM_KIND_MASK;
+    ASSERT(kind < RECLAIM_NUM_KINDS && sRecycleFuncs[kind]);
+    sRecycleFuncs[kind](EntryPtr(entry));
+}
+
+void SetRecycleFunc(size_t kind, RecycleFunc func)
+{
+    ASSERT(kind < RECLAIM_NUM_KINDS);
+    sRecycleFuncs[kind] = func;
+}
+
+// moves all entries in bag list to their free lists
+static void RecycleLimbo(LimboBag* bag)
+{
+    size_t recycled = 0;
+    while (bag)
+    {
+        for (size_t i = 0; i < bag->count; ++i)
+            RecycleEntry(bag->entries[i]);
+
+        recycled += bag->count;
+        LimboBag* next = bag->next;
+        bag->next = sSpareBags;
+        sSpareBags = bag;
+        bag = next;
+    }
+
+    sNumRetiredEntries.fetch_sub(recycled, std::memory_order_relaxed);
+}
+
+// recycle all limbo lists that are safe to reuse in epoch `epoch`
+static void ReclaimLimbo(size_t epoch)
+{
+    for (size_t i = 0; i < EPOCH_NUM_LIMBO; ++i)
+    {
+        if (sLimbo[i] == nullptr || sLimboEpoch[i] + 2 > epoch)
+            continue;
+
+        RecycleLimbo(sLimbo[i]);
+        sLimbo[i] = nullptr;
+    }
+
+    // adopt bags left behind by exited threads
+    if (sOrphanEpochBags.load(std::memory_order_relaxed) == nullptr)
+        return;
+
+    LimboBag* bag = sOrphanEpochBags.exchange(nullptr);
+    while (bag)
+    {
+        LimboBag* next = bag->next;
+        if (bag->epoch + 2 <= epoch)
+        {
+            bag->next = nullptr;
+            RecycleLimbo(bag);
+        }
+        else
+            PushOrphanBag(sOrphanEpochBags, bag); // not safe yet, give it back
+
+        bag = next;
+    }
+}
+
+// global epoch can only advance once all active threads announced it
+static void TryAdvanceEpoch()
+{
+    size_t epoch = sEpoch.load();
+    for (ThreadRecord* rec = sThreadRecords.load(); rec; rec = rec->next)
+    {
+        size_t announced = rec->epoch.load();
+        if ((announced & EPOCH_ACTIVE_MASK) && (announced >> 1) != epoch)
+            return;
+    }
+
+    sEpoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+EpochGuard::EpochGuard()
+{
+    if (sEpochDepth++ > 0)
+        return;
+
+    if (UNLIKELY(sReclaimRecord == nullptr))
+        sReclaimRecord = AcquireThreadRecord();
+
+    // announce, then make sure announcement isn't stale
+    size_t epoch = sEpoch.load();
+    while (true)
+    {
+        sReclaimRecord->epoch.store((epoch << 1) | EPOCH_ACTIVE_MASK);
+        size_t current = sEpoch.load();
+        if (current == epoch)
+            break;
+
+        epoch = current;
+    }
+
+    ReclaimLimbo(epoch);
+}
+
+EpochGuard::~EpochGuard()
+{
+    if (--sEpochDepth > 0)
+        return;
+
+    sReclaimRecord->epoch.store(0, std::memory_order_release);
+}
+
+void RetireEpoch(void* entry, size_t kind)
+{
+    ASSERT(sEpochDepth > 0);
+    ASSERT(((size_t)entry & RECLAIM_KIND_MASK) == 0);
+    sNumRetiredEntries.fetch_add(1, std::memory_order_relaxed);
+
+    size_t epoch = sEpoch.load();
+    size_t idx = epoch % EPOCH_NUM_LIMBO;
+    // limbo list still holds entries from an older epoch
+    // which is at least EPOCH_NUM_LIMBO epochs behind, so safe to reuse
+    if (sLimboEpoch[idx] != epoch)
+    {
+        if (sLimbo[idx])
+            RecycleLimbo(sLimbo[idx]);
+
+        sLimbo[idx] = nullptr;
+        sLimboEpoch[idx] = epoch;
+    }
+
+    // bags keep the entry kind in the stored pointer
+    PushEntry(sLimbo[idx], (void*)((size_t)entry | kind), epoch);
+
+    if (++sNumRetires % EPOCH_ADVANCE_FREQ == 0)
+        TryAdvanceEpoch();
+}
+
+static void ScanHazards()
+{
+    // adopt entries left behind by exited threads
+    if (sOrphanHazardBags.load(std::memory_order_relaxed) != nullptr)
+    {
+        LimboBag* bag = sOrphanHazardBags.exchange(nullptr);
+        while (bag)
+        {
+            LimboBag* next = bag->next;
+            bag->next = sRetired;
+            sRetired = bag;
+            sNumRetired += bag->count;
+            bag = next;
+        }
+    }
+
+    // snapshot published hazards
+    size_t numHazards = 0;
+    for (ThreadRecord* rec = sThreadRecords.load(); rec; rec = rec->next)
+    {
+        for (size_t i = 0; i < RECLAIM_NUM_HAZARDS; ++i)
+        {
+            void* entry = rec->hazards[i].load();
+            if (entry == nullptr)
+                continue;
+
+            if (numHazards == sHazardsSize)
+            {
+                // grow snapshot buffer
+                size_t size = std::max(PAGE, sHazardsSize * sizeof(void*) * 2);
+                void** hazards = (void**)PageAlloc(size);
+                if (UNLIKELY(hazards == nullptr))
+                    abort();
+
+                if (sHazards)
+                {
+                    std::copy(sHazards, sHazards + numHazards, hazards);
+                    PageFree(sHazards, sHazardsSize * sizeof(void*));
+                }
+
+                sHazards = hazards;
+                sHazardsSize = size / sizeof(void*);
+            }
+
+            sHazards[numHazards++] = entry;
+        }
+    }
+
+    std::sort(sHazards, sHazards + numHazards);
+
+    // compact entries still in use into the first bags, recycle the rest
+    LimboBag* dst = sRetired;
+    size_t dstIdx = 0;
+    size_t kept = 0;
+    size_t recycled = 0;
+    for (LimboBag* bag = sRetired; bag; bag = bag->next)
+    {
+        for (size_t i = 0; i < bag->count; ++i)
+        {
+            void* entry = bag->entries[i];
+            if (!std::binary_search(sHazards, sHazards + numHazards, EntryPtr(entry)))
+            {
+                RecycleEntry(entry);
+                recycled++;
+                continue;
+            }
+
+            if (dstIdx == LIMBO_BAG_CAPACITY)
+            {
+                dst->count = dstIdx;
+                dst = dst->next;
+                dstIdx = 0;
+            }
+
+            dst->entries[dstIdx++] = entry;
+            kept++;
+        }
+    }
+
+    // release now empty bags
+    if (kept == 0)
+        dst = nullptr;
+    else
+        dst->count = dstIdx;
+
+    LimboBag* empty = dst ? dst->next : sRetired;
+    if (dst)
+        dst->next = nullptr;
+    else
+        sRetired = nullptr;
+
+    while (empty)
+    {
+        LimboBag* next = empty->next;
+        empty->next = sSpareBags;
+        sSpareBags = empty;
+        empty = next;
+    }
+
+    sNumRetired = kept;
+    sNumRetiredEntries.fetch_sub(recycled, std::memory_order_relaxed);
+}
+
+HazardGuard::HazardGuard()
+{
+    if (sHazardDepth++ > 0)
+        return;
+
+    if (UNLIKELY(sReclaimRecord == nullptr))
+        sReclaimRecord = AcquireThreadRecord();
+}
+
+HazardGuard::~HazardGuard()
+{
+    if (--sHazardDepth > 0)
+        return;
+
+    for (size_t i = 0; i < RECLAIM_NUM_HAZARDS; ++i)
+        sReclaimRecord->hazards[i].store(nullptr, std::memory_order_release);
+}
+
+void RetireHazard(void* entry, size_t kind)
+{
+    ASSERT(sHazardDepth > 0);
+    ASSERT(((size_t)entry & RECLAIM_KIND_MASK) == 0);
+    sNumRetiredEntries.fetch_add(1, std::memory_order_relaxed);
+
+    PushEntry(sRetired, (void*)((size_t)entry | kind), 0);
+
+    size_t threshold = HP_SCAN_FACTOR * RECLAIM_NUM_HAZARDS * sNumThreadRecords.load();
+    if (++sNumRetired >= std::max((size_t)HP_SCAN_MIN, threshold))
+        ScanHazards();
+}
+
+size_t GetNumRetiredEntries()
+{
+    return sNumRetiredEntries.load(std::memory_order_relaxed);
+}
+
+void ReclaimThreadFinalize()
+{
+    // hand off retired entries, other threads will recycle them
+    for (size_t i = 0; i < EPOCH_NUM_LIMBO; ++i)
+    {
+        LimboBag* bag = sLimbo[i];
+        while (bag)
+        {
+            LimboBag* next = bag->next;
+            PushOrphanBag(sOrphanEpochBags, bag);
+            bag = next;
+        }
+
+        sLimbo[i] = nullptr;
+    }
+
+    if (sReclaimRecord && sRetired)
+        ScanHazards();
+
+    while (sRetired)
+    {
+        LimboBag* next = sRetired->next;
+        PushOrphanBag(sOrphanHazardBags, sRetired);
+        sRetired = next;
+    }
+
+    sNumRetired = 0;
+    if (sHazards)
+    {
+        PageFree(sHazards, sHazardsSize * sizeof(void*));
+        sHazards = nullptr;
+        sHazardsSize = 0;
+    }
+
+    while (sSpareBags)
+    {
+        LimboBag* next = sSpareBags->next;
+        PageFree(sSpareBags, PAGE);
+        sSpareBags = next;
+    }
+
+    if (sReclaimRecord)
+        sReclaimRecord->epoch.store(0);
+
+    ReleaseThreadRecord();
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#ifndef __RECLAIM_H
+#define __RECLAIM_H
+
+// safe memory reclamation, shared by the block indexes
+// nodes removed from an index may still be read by concurrent operations,
+//  so they are retired, and only recycled once no operation can reach them
+// epoch-based: threads announce the global epoch while operating on an
+//  index, and entries retired while the global epoch is `e` are only
+//  recycled once the global epoch reaches `e + 2`
+// hazard pointers: threads publish every node they are about to
+//  dereference, and retired entries are only recycled once no thread
+//  publishes them
+// both schemes share thread records and retired entry bags, each index
+//  picks one and uses its guard and retire function
+
+#include <atomic>
+
+#include "defines.h"
+#include "log.h"
+
+// kinds of retired entries, each recycled by its own function
+// kind is kept in the entry's lowest bits, so entries must be aligned
+//  to RECLAIM_KIND_MASK + 1
+#define RECLAIM_TREE_NODE 0
+#define RECLAIM_TREE_LEAF 1
+#define RECLAIM_SKIP_NODE 2
+#define RECLAIM_NUM_KINDS 3
+#define RECLAIM_KIND_MASK ((size_t)0x3)
+
+STATIC_ASSERT(RECLAIM_NUM_KINDS <= RECLAIM_KIND_MASK + 1, "Invalid reclaim kinds");
+
+// hazard slots per thread, enough for the index that needs the most
+#define RECLAIM_NUM_HAZARDS 6
+
+// per-thread reclamation state visible to other threads
+// records are never released to the OS, only reused by other threads
+struct ThreadRecord
+{
+    // announced epoch is shifted, lowest bit marks thread as active
+    std::atomic<size_t> epoch;
+    std::atomic<void*> hazards[RECLAIM_NUM_HAZARDS];
+    std::atomic<bool> inUse;
+    ThreadRecord* next;
+};
+
+// returns an entry that is no longer reachable to its free list
+typedef void (*RecycleFunc)(void* entry);
+
+// record of current thread, valid within a guard
+extern __thread ThreadRecord* sReclaimRecord CMALLOC_TLS_INIT_EXEC;
+
+// must be set for every kind before its first entry is retired
+void SetRecycleFunc(size_t kind, RecycleFunc func);
+
+// marks thread as operating on an index for the guard's lifetime
+// guards can be nested
+class EpochGuard
+{
+public:
+    EpochGuard();
+    ~EpochGuard();
+};
+
+// guards can be nested, hazards are cleared when outermost guard exits
+class HazardGuard
+{
+public:
+    HazardGuard();
+    ~HazardGuard();
+};
+
+// publishes entry in hazard slot, must be called within a HazardGuard
+CMALLOC_INLINE void PublishHazard(size_t slot, void* entry)
+{
+    ASSERT(slot < RECLAIM_NUM_HAZARDS);
+    sReclaimRecord->hazards[slot].store(entry);
+}
+
+// entry is unreachable, but may still be in use by concurrent operations
+// must be called within a guard of the same scheme
+void RetireEpoch(void* entry, size_t kind);
+void RetireHazard(void* entry, size_t kind);
+
+// number of entries retired but not yet recycled
+size_t GetNumRetiredEntries();
+// must be called on thread exit, hands off retired entries to other threads
+// recycles what it can, so index free lists must be flushed afterwards
+void ReclaimThreadFinalize();
+
+#endif // __RECLAIM_H
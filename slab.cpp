@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#include <atomic>
+#include <new>
+#include <algorithm> // for max()
+
+#include "slab.h"
+#include "internal.h"
+#include "pages.h"
+#include "tcache.h"
+#include "log.h"
+
+// superblock states
+// FULL: all free objects belong to a thread cache, or none are free
+// PARTIAL: superblock has free objects, and descriptor is in partial list
+// EMPTY: all objects are free, superblock was returned to coa
+#define SB_FULL     0
+#define SB_PARTIAL  1
+#define SB_EMPTY    2
+
+// size of descriptor pool chunks
+#define DESC_CHUNK_SIZE ((size_t)1 << 16)
+
+// free objects are linked through their first word, by object index
+struct Anchor
+{
+    uint64_t state : 2;
+    uint64_t avail : 31;
+    uint64_t count : 31;
+};
+
+STATIC_ASSERT(sizeof(Anchor) == sizeof(uint64_t), "Invalid Anchor size");
+
+// superblock descriptor
+// descriptors are never returned to the OS, so they can safely be read
+//  by threads holding stale pointers to them
+struct Descriptor
+{
+    std::atomic<Anchor> anchor;
+    // next descriptor in partial or free list
+    std::atomic<Descriptor*> next;
+    char* superblock;
+    size_t sbSize;
+    size_t objSize;
+    size_t maxCount;
+} CMALLOC_CACHE_ALIGNED;
+
+// tagged head of a lock free descriptor list
+struct DescriptorListHead
+{
+    Descriptor* desc;
+    size_t tag;
+};
+
+struct DescriptorList
+{
+    std::atomic<DescriptorListHead> head;
+} CMALLOC_CACHE_ALIGNED;
+
+// thread cache of free objects, linked through their first word
+struct SlabCacheBin
+{
+    char* head;
+    size_t count;
+};
+
+// global variables
+static size_t sClassSizes[SLAB_NUM_CLASSES];
+static size_t sClassSbSizes[SLAB_NUM_CLASSES];
+static std::atomic<bool> sClassesInit(false);
+// partial superblocks, per size class
+static DescriptorList sPartial[SLAB_NUM_CLASSES];
+// unused descriptors
+static DescriptorList sFreeDescriptors;
+
+// thread-local variables
+static __thread SlabCacheBin sCache[SLAB_NUM_CLASSES];
+
+static void InitClasses()
+{
+    size_t sc = 0;
+    for (size_t size = SLAB_MIN_ALIGN; size <= 128; size += SLAB_MIN_ALIGN)
+        sClassSizes[sc++] = size;
+
+    for (size_t base = 128; base < SLAB_MAX_SIZE; base *= 2)
+    {
+        for (size_t i = 1; i <= 4; ++i)
+            sClassSizes[sc++] = base + i * (base / 4);
+    }
+
+    ASSERT(sc == SLAB_NUM_CLASSES);
+    ASSERT(sClassSizes[SLAB_NUM_CLASSES - 1] == SLAB_MAX_SIZE);
+
+    for (sc = 0; sc < SLAB_NUM_CLASSES; ++sc)
+    {
+        size_t size = std::max(SLAB_SB_SIZE,
+                SLAB_SB_MIN_OBJECTS * sClassSizes[sc]);
+        sClassSbSizes[sc] = PAGE_CEILING(size);
+    }
+
+    sClassesInit.store(true, std::memory_order_release);
+}
+
+static inline size_t SizeToClass(size_t size)
+{
+    if (size <= 128)
+        return (size > 0) ? (size - 1) / SLAB_MIN_ALIGN : 0;
+
+    // 4 classes per power of 2
+    size_t lg = 63 - __builtin_clzl(size - 1);
+    size_t idx = ((size - 1) >> (lg - 2)) - 4;
+    return 8 + (lg - 7) * 4 + idx;
+}
+
+static void ListPush(DescriptorList* list, Descriptor* desc)
+{
+    DescriptorListHead oldHead = list->head.load();
+    DescriptorListHead newHead;
+    do
+    {
+        desc->next.store(oldHead.desc);
+        newHead.desc = desc;
+        newHead.tag = oldHead.tag + 1;
+    }
+    while (!list->head.compare_exchange_weak(oldHead, newHead));
+}
+
+static Descriptor* ListPop(DescriptorList* list)
+{
+    DescriptorListHead oldHead = list->head.load();
+    DescriptorListHead newHead;
+    do
+    {
+        if (oldHead.desc == nullptr)
+            return nullptr;
+
+        // descriptors are type-stable, reading a stale one is safe
+        newHead.desc = oldHead.desc->next.load();
+        newHead.tag = oldHead.tag + 1;
+    }
+    while (!list->head.compare_exchange_weak(oldHead, newHead));
+
+    return oldHead.desc;
+}
+
+static Descriptor* DescriptorAlloc()
+{
+    while (true)
+    {
+        Descriptor* desc = ListPop(&sFreeDescriptors);
+        if (desc)
+            return desc;
+
+        // carve up a new chunk into descriptors, keep first one
+        char* chunk = (char*)PageAlloc(DESC_CHUNK_SIZE);
+        if (UNLIKELY(chunk == nullptr))
+            return nullptr;
+
+        size_t const numDescs = DESC_CHUNK_SIZE / sizeof(Descriptor);
+        for (size_t i = 1; i < numDescs; ++i)
+            ListPush(&sFreeDescriptors, new (chunk + i * sizeof(Descriptor)) Descriptor());
+
+        return new (chunk) Descriptor();
+    }
+}
+
+static inline PageInfo DescriptorToPageInfo(Descriptor* desc)
+{
+    return PageInfo((int64_t)desc | PI_SLAB_FLAG);
+}
+
+static inline Descriptor* PageInfoToDescriptor(PageInfo info)
+{
+    ASSERT(info.IsSlab());
+    return (Descriptor*)(info.size & ~PI_FLAGS_MASK);
+}
+
+// superblock page map info is set on every page
+// chunk flags of pages are preserved
+static void RegisterSuperblock(Descriptor* desc)
+{
+    // superblock was allocated as a regular block
+    ClearBlock(TKey(desc->sbSize, desc->superblock));
+    PageInfo info = DescriptorToPageInfo(desc);
+    for (size_t off = 0; off < desc->sbSize; off += PAGE)
+        SetPageInfoKeepChunk(desc->superblock + off, info);
+}
+
+static void ReleaseSuperblock(Descriptor* desc)
+{
+    for (size_t off = 0; off < desc->sbSize; off += PAGE)
+        SetPageInfoKeepChunk(desc->superblock + off, PageInfo(0));
+
+    TKey key(desc->sbSize, desc->superblock);
+    SetBlock(key);
+    TCacheFree(key);
+}
+
+// move `count` objects starting at index `avail` to thread cache
+static void CacheObjects(SlabCacheBin* bin, Descriptor* desc,
+        size_t avail, size_t count)
+{
+    char* sb = desc->superblock;
+    for (size_t i = 0; i < count; ++i)
+    {
+        char* obj = sb + avail * desc->objSize;
+        avail = *(size_t*)obj;
+        *(char**)obj = bin->head;
+        bin->head = obj;
+    }
+
+    bin->count += count;
+}
+
+// take all free objects from a partial superblock
+static bool FillFromPartial(size_t sc, SlabCacheBin* bin)
+{
+    while (true)
+    {
+        Descriptor* desc = ListPop(&sPartial[sc]);
+        if (desc == nullptr)
+            return false;
+
+        Anchor oldAnchor = desc->anchor.load();
+        Anchor newAnchor;
+        do
+        {
+            // superblock was already released, descriptor can be reused
+            if (oldAnchor.state == SB_EMPTY)
+                break;
+
+            ASSERT(oldAnchor.state == SB_PARTIAL);
+            ASSERT(oldAnchor.count > 0);
+            newAnchor = oldAnchor;
+            newAnchor.state = SB_FULL;
+            newAnchor.count = 0;
+        }
+        while (!desc->anchor.compare_exchange_weak(oldAnchor, newAnchor));
+
+        if (oldAnchor.state == SB_EMPTY)
+        {
+            ListPush(&sFreeDescriptors, desc);
+            continue;
+        }
+
+        CacheObjects(bin, desc, oldAnchor.avail, oldAnchor.count);
+        return true;
+    }
+}
+
+// allocate a new superblock, and cache all its objects
+static bool FillFromNewSuperblock(size_t sc, SlabCacheBin* bin)
+{
+    Descriptor* desc = DescriptorAlloc();
+    if (UNLIKELY(desc == nullptr))
+        return false;
+
+    size_t sbSize = sClassSbSizes[sc];
+    char* sb = TCacheAlloc(sbSize);
+    if (UNLIKELY(sb == nullptr))
+    {
+        ListPush(&sFreeDescriptors, desc);
+        return false;
+    }
+
+    desc->superblock = sb;
+    desc->sbSize = sbSize;
+    desc->objSize = sClassSizes[sc];
+    desc->maxCount = sbSize / desc->objSize;
+
+    Anchor anchor;
+    anchor.state = SB_FULL;
+    anchor.avail = 0;
+    anchor.count = 0;
+    desc->anchor.store(anchor);
+
+    RegisterSuperblock(desc);
+
+    // all objects go straight to thread cache
+    for (size_t i = desc->maxCount; i-- > 0; )
+    {
+        char* obj = sb + i * desc->objSize;
+        *(char**)obj = bin->head;
+        bin->head = obj;
+    }
+
+    bin->count += desc->maxCount;
+    return true;
+}
+
+// return a list of objects from the same superblock
+static void FlushObjects(Descriptor* desc, char* first, char* last,
+        size_t count)
+{
+    char* sb = desc->superblock;
+    size_t firstIdx = (first - sb) / desc->objSize;
+
+    Anchor oldAnchor = desc->anchor.load();
+    Anchor newAnchor;
+    do
+    {
+        ASSERT(oldAnchor.state != SB_EMPTY);
+        *(size_t*)last = oldAnchor.avail;
+        newAnchor = oldAnchor;
+        newAnchor.avail = firstIdx;
+        newAnchor.count += count;
+        if (newAnchor.count == desc->maxCount)
+            newAnchor.state = SB_EMPTY;
+        else if (oldAnchor.state == SB_FULL)
+            newAnchor.state = SB_PARTIAL;
+    }
+    while (!desc->anchor.compare_exchange_weak(oldAnchor, newAnchor));
+
+    if (newAnchor.state == SB_EMPTY)
+    {
+        ReleaseSuperblock(desc);
+        // if descriptor is in partial list, it is recycled once popped
+        if (oldAnchor.state == SB_FULL)
+            ListPush(&sFreeDescriptors, desc);
+    }
+    else if (oldAnchor.state == SB_FULL)
+        ListPush(&sPartial[SizeToClass(desc->objSize)], desc);
+}
+
+// flush thread cache bin until at most `target` objects remain
+static void FlushBin(SlabCacheBin* bin, size_t target)
+{
+    while (bin->count > target)
+    {
+        // gather run of objects from the same superblock
+        char* first = bin->head;
+        PageInfo info = GetPageInfoForPtr(first);
+        Descriptor* desc = PageInfoToDescriptor(info);
+        char* sbEnd = desc->superblock + desc->sbSize;
+
+        char* last = first;
+        size_t count = 1;
+        char* next = *(char**)first;
+        // relink run through object indexes
+        while (bin->count - count > target && next &&
+               next >= desc->superblock && next < sbEnd)
+        {
+            *(size_t*)last = (next - desc->superblock) / desc->objSize;
+            last = next;
+            next = *(char**)next;
+            count++;
+        }
+
+        bin->head = next;
+        bin->count -= count;
+        FlushObjects(desc, first, last, count);
+    }
+}
+
+void* SlabAlloc(size_t size)
+{
+    ASSERT(size <= SLAB_MAX_SIZE);
+
+    if (UNLIKELY(!sClassesInit.load(std::memory_order_acquire)))
+        InitClasses();
+
+    size_t sc = SizeToClass(size);
+    SlabCacheBin* bin = &sCache[sc];
+    if (UNLIKELY(bin->head == nullptr))
+    {
+        if (!FillFromPartial(sc, bin) && !FillFromNewSuperblock(sc, bin))
+            return nullptr;
+    }
+
+    char* obj = bin->head;
+    bin->head = *(char**)obj;
+    bin->count--;
+    return obj;
+}
+
+void SlabFree(PageInfo info, void* ptr)
+{
+    Descriptor* desc = PageInfoToDescriptor(info);
+    ASSERT(((char*)ptr - desc->superblock) % desc->objSize == 0);
+
+    size_t sc = SizeToClass(desc->objSize);
+    SlabCacheBin* bin = &sCache[sc];
+    *(char**)ptr = bin->head;
+    bin->head = (char*)ptr;
+    bin->count++;
+
+    // keep at most 2 superblocks worth of objects cached
+    if (UNLIKELY(bin->count > 2 * desc->maxCount))
+        FlushBin(bin, desc->maxCount);
+}
+
+size_t SlabUsableSize(PageInfo info)
+{
+    Descriptor* desc = PageInfoToDescriptor(info);
+    return desc->objSize;
+}
+
+void SlabFlush()
+{
+    for (size_t sc = 0; sc < SLAB_NUM_CLASSES; ++sc)
+        FlushBin(&sCache[sc], 0);
+}
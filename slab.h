@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include "defines.h"
+#include "pagemap.h"
+
+// small object allocation
+// small objects are carved from superblocks, page blocks obtained from coa
+//  that are split into objects of a single size class
+// every page of a superblock stores its descriptor in the page map
+// objects are only aligned to SLAB_MIN_ALIGN
+// largest object size served by slabs
+#define SLAB_MAX_SIZE ((size_t)1 << 15)
+#define SLAB_MIN_ALIGN ((size_t)16)
+// size classes
+// multiples of 16 up to 128, then 4 classes per power of 2
+#define SLAB_NUM_CLASSES 40
+// minimum superblock size, and minimum number of objects per superblock
+#define SLAB_SB_SIZE ((size_t)1 << 16)
+#define SLAB_SB_MIN_OBJECTS 8
+
+// allocate an object with at least `size` bytes, size <= SLAB_MAX_SIZE
+void* SlabAlloc(size_t size);
+// free an object, `info` is page map info for the object's page
+void SlabFree(PageInfo info, void* ptr);
+// size of the object's size class
+size_t SlabUsableSize(PageInfo info);
+// return all objects cached by calling thread to their superblocks
+// must be called on thread exit
+void SlabFlush();
+
+#endif // __SLAB_H
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#include <algorithm> // for max()
+
+#include "tcache.h"
+#include "internal.h"
+#include "log.h"
+
+// blocks linked through their first word
+struct TCacheBin
+{
+    char* head;
+    size_t count;
+};
+
+// global variables
+std::atomic<size_t> sTCacheBudget(TCACHE_BUDGET);
+
+// thread-local variables
+// bins indexed by number of pages
+static __thread TCacheBin sBins[TCACHE_MAX_PAGES + 1];
+static __thread size_t sCachedBytes = 0;
+
+static inline void BinPush(TCacheBin* bin, char* block, size_t size)
+{
+    *(char**)block = bin->head;
+    bin->head = block;
+    bin->count++;
+    sCachedBytes += size;
+}
+
+static inline char* BinPop(TCacheBin* bin, size_t size)
+{
+    char* block = bin->head;
+    ASSERT(block);
+    bin->head = *(char**)block;
+    bin->count--;
+    sCachedBytes -= size;
+    return block;
+}
+
+// flush cached blocks until at most `target` bytes remain
+// largest blocks are flushed first, they are the most costly to keep
+static void TCacheFlushTo(size_t target)
+{
+    for (size_t pages = TCACHE_MAX_PAGES; pages > 0; --pages)
+    {
+        TCacheBin* bin = &sBins[pages];
+        size_t size = pages * PAGE;
+        while (bin->head && sCachedBytes > target)
+        {
+            char* block = BinPop(bin, size);
+            // coalesces with free neighbours, as a regular free would
+            FreeBlock(TKey(size, block));
+        }
+    }
+}
+
+// carve a batch of blocks from a single shared storage block
+static char* TCacheRefill(size_t size)
+{
+    size_t count = std::max((size_t)1, TCACHE_REFILL_BYTES / size);
+    // don't refill beyond budget
+    size_t budget = sTCacheBudget.load(std::memory_order_relaxed);
+    while (count > 1 && sCachedBytes + (count - 1) * size > budget)
+        count /= 2;
+
+    char* block = nullptr;
+    if (count > 1)
+        block = AllocBlock(count * size);
+
+    if (block == nullptr)
+        return AllocBlock(size);
+
+    // split block, and cache all but the first
+    ClearBlock(TKey(count * size, block));
+    TCacheBin* bin = &sBins[size >> LG_PAGE];
+    for (size_t i = count; i-- > 0; )
+    {
+        char* b = block + i * size;
+        SetBlock(TKey(size, b));
+        if (i > 0)
+            BinPush(bin, b, size);
+    }
+
+    return block;
+}
+
+char* TCacheAlloc(size_t size)
+{
+    if (UNLIKELY(size == 0))
+        size = PAGE;
+
+    ASSERT((size & PAGE_MASK) == 0);
+
+    size_t pages = size >> LG_PAGE;
+    if (pages > TCACHE_MAX_PAGES)
+    {
+        if (UNLIKELY(IsDirectSize(size)))
+            return AllocChunkBlock(size, true);
+
+        return AllocBlock(size);
+    }
+
+    TCacheBin* bin = &sBins[pages];
+    if (LIKELY(bin->head != nullptr))
+        return BinPop(bin, size);
+
+    return TCacheRefill(size);
+}
+
+void TCacheFree(TKey key)
+{
+    ASSERT((key.size & PAGE_MASK) == 0);
+
+    size_t pages = key.size >> LG_PAGE;
+    size_t budget = sTCacheBudget.load(std::memory_order_relaxed);
+    if (pages > TCACHE_MAX_PAGES || key.size > budget)
+    {
+        FreeBlock(key);
+        return;
+    }
+
+    BinPush(&sBins[pages], key.address, key.size);
+
+    // flush in batches, down to half the budget
+    if (UNLIKELY(sCachedBytes > budget))
+        TCacheFlushTo(budget / 2);
+}
+
+void TCacheFlush()
+{
+    TCacheFlushTo(0);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#ifndef __TCACHE_H
+#define __TCACHE_H
+
+#include <atomic>
+
+#include "defines.h"
+#include "lfbstree.h"
+
+// thread-local cache of free blocks, keyed by number of pages
+// cached blocks keep their page map info, and aren't coalesced
+//  until they are flushed back to the shared storage
+// only blocks up to this many pages are cached
+#define TCACHE_MAX_PAGES 16
+// default max bytes cached per thread, before flushing
+#define TCACHE_BUDGET ((size_t)1 << 20)
+// on a miss, refill with up to this many bytes worth of blocks
+#define TCACHE_REFILL_BYTES ((size_t)1 << 15)
+
+// max bytes cached per thread, can be changed at runtime
+extern std::atomic<size_t> sTCacheBudget;
+
+// allocate a block with `size` bytes, size must be a multiple of PAGE
+char* TCacheAlloc(size_t size);
+// free a previously allocated block
+void TCacheFree(TKey key);
+// return all cached blocks to the shared storage
+// must be called on thread exit
+void TCacheFlush();
+
+#endif // __TCACHE_H
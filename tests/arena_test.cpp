@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+// block placement with emulated numa nodes
+// built with ARENA_FAKE_NODES, see Makefile
+
+#include <sched.h>
+
+#include "test.h"
+#include "../coa.h"
+#include "../arena.h"
+#include "../internal.h"
+
+#if ARENA_FAKE_NODES < 2
+#error "arena_test needs ARENA_FAKE_NODES >= 2"
+#endif
+
+// arena map records every huge page of a chunk, at any address
+static void TestArenaMap()
+{
+    char* const addrs[] = {
+        (char*)((size_t)1 << 30),
+        (char*)((size_t)1 << 40) + 5 * HUGEPAGE,
+        (char*)((size_t)1 << PM_ADDR_BITS) - 4 * HUGEPAGE,
+    };
+
+    for (char* addr : addrs)
+    {
+        // chunks aren't bound to nodes in fake mode, no memory needed
+        SetArenaForChunk(addr, 4 * HUGEPAGE, ARENA_FAKE_NODES - 1);
+        for (size_t off = 0; off < 4 * HUGEPAGE; off += HUGEPAGE / 2)
+            CHECK(GetArenaForPtr(addr + off) == ARENA_FAKE_NODES - 1);
+
+        // a chunk covering part of the range doesn't affect the rest
+        SetArenaForChunk(addr + HUGEPAGE, HUGEPAGE + PAGE, 1);
+        CHECK(GetArenaForPtr(addr) == ARENA_FAKE_NODES - 1);
+        CHECK(GetArenaForPtr(addr + HUGEPAGE) == 1);
+        CHECK(GetArenaForPtr(addr + 3 * HUGEPAGE - PAGE) == 1);
+        CHECK(GetArenaForPtr(addr + 3 * HUGEPAGE) == ARENA_FAKE_NODES - 1);
+    }
+}
+
+// blocks come from the arena of the cpu's emulated node, and are freed
+//  back to it
+static void TestPlacement()
+{
+    cpu_set_t cpus;
+    CHECK(sched_getaffinity(0, sizeof(cpus), &cpus) == 0);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (!CPU_ISSET(cpu, &cpus))
+            continue;
+
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) != 0)
+            continue;
+
+        size_t arena = cpu % ARENA_FAKE_NODES;
+        CHECK(GetCurrentArena() == arena);
+        CHECK(GetArenaNode(arena) == arena);
+
+        char* block = AllocBlock(64 * PAGE);
+        CHECK(block != nullptr);
+        CHECK(GetArenaForPtr(block) == arena);
+        CHECK(GetArenaForPtr(block + 64 * PAGE - 1) == arena);
+        FreeBlock(TKey(64 * PAGE, block));
+
+        // with internal storage only, freed block is found again
+        block = AllocBlock(64 * PAGE, 0);
+        CHECK(block != nullptr);
+        CHECK(GetArenaForPtr(block) == arena);
+        FreeBlock(TKey(64 * PAGE, block));
+    }
+
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+int main()
+{
+    coa_init();
+    CHECK(sNumArenas == ARENA_FAKE_NODES);
+
+    TestArenaMap();
+    TestPlacement();
+    return TEST_RESULT("arena_test");
+}
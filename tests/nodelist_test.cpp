@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+// numa node list parsing, node ids may be sparse
+// includes arena.cpp to reach its static functions
+
+#include <cstring>
+
+#include "test.h"
+#include "../arena.cpp"
+
+static size_t Parse(char const* list, uint16_t* nodes, size_t max = ARENA_MAX_NODES)
+{
+    return ParseNodeList(list, strlen(list), nodes, max);
+}
+
+int main()
+{
+    uint16_t nodes[ARENA_MAX_NODES];
+
+    CHECK(Parse("0\n", nodes) == 1 && nodes[0] == 0);
+    CHECK(Parse("", nodes) == 0);
+
+    CHECK(Parse("0-3\n", nodes) == 4);
+    CHECK(nodes[0] == 0 && nodes[3] == 3);
+
+    // sparse and offline nodes
+    CHECK(Parse("0,2,5-6,17\n", nodes) == 5);
+    CHECK(nodes[0] == 0 && nodes[1] == 2 && nodes[2] == 5 &&
+            nodes[3] == 6 && nodes[4] == 17);
+
+    // no trailing newline
+    CHECK(Parse("1-2", nodes) == 2 && nodes[0] == 1 && nodes[1] == 2);
+
+    // ids past the tables are skipped
+    CHECK(Parse("0-1,8-9,1023-1030\n", nodes, 9) == 3);
+    CHECK(nodes[2] == 8);
+    CHECK(Parse("0,1023-1030\n", nodes) == 2 && nodes[1] == 1023);
+
+    return TEST_RESULT("nodelist_test");
+}
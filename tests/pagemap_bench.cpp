@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+// page map lookup latency and memory, array vs radix tree
+// built once per PAGEMAP_IMPL value, see Makefile
+// usage: pagemap_bench [lookups]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../pagemap.h"
+
+// dense: a contiguous heap of this many pages
+#define BENCH_DENSE_PAGES (1ULL << 18)
+// sparse: this many single pages, each in its own 1 GiB region
+#define BENCH_SPARSE_PAGES (1ULL << 10)
+
+// reads VmSize and VmRSS in KiB
+static void GetMemory(size_t& vm, size_t& rss)
+{
+    vm = rss = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == nullptr)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        if (strncmp(line, "VmSize:", 7) == 0)
+            vm = atol(line + 7);
+        else if (strncmp(line, "VmRSS:", 6) == 0)
+            rss = atol(line + 6);
+    }
+
+    fclose(f);
+}
+
+// entries are only stored in the map, no memory is mapped there
+static void RunBench(char const* name, char* base, size_t stride,
+        size_t numPages, size_t numLookups)
+{
+    size_t vm0, rss0;
+    GetMemory(vm0, rss0);
+    for (size_t i = 0; i < numPages; ++i)
+        sPageMap.SetPageInfo(base + i * stride, PageInfo((int64_t)PAGE));
+
+    size_t vm1, rss1;
+    GetMemory(vm1, rss1);
+
+    // random lookups, dependent on each other so they can't overlap
+    uint64_t x = 1;
+    int64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < numLookups; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        size_t idx = (x + sum) % numPages;
+        sum += sPageMap.GetPageInfo(base + idx * stride).GetSize() >> LG_PAGE;
+    }
+
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (sum != (int64_t)numLookups)
+        abort();
+
+    printf("%s %s: %.1f ns/lookup, VmSize +%zu KiB, VmRSS +%zu KiB\n",
+            PAGEMAP_IMPL == PAGEMAP_ARRAY ? "array" : "radix", name,
+            elapsed.count() / numLookups, vm1 - vm0, rss1 - rss0);
+}
+
+int main(int argc, char** argv)
+{
+    size_t numLookups = argc > 1 ? atol(argv[1]) : 20000000;
+
+    size_t vm0, rss0;
+    GetMemory(vm0, rss0);
+    sPageMap.Init();
+    size_t vm1, rss1;
+    GetMemory(vm1, rss1);
+    printf("%s init: VmSize +%zu KiB, VmRSS +%zu KiB\n",
+            PAGEMAP_IMPL == PAGEMAP_ARRAY ? "array" : "radix",
+            vm1 - vm0, rss1 - rss0);
+
+    RunBench("dense", (char*)((size_t)1 << 46), PAGE, BENCH_DENSE_PAGES, numLookups);
+    RunBench("sparse", (char*)((size_t)1 << 40), (size_t)1 << 30,
+            BENCH_SPARSE_PAGES, numLookups);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+// page map with a 57-bit address space
+// built with PAGEMAP_IMPL=1 PM_ADDR_BITS=57, see Makefile
+
+#include <sys/mman.h>
+#include <cstring>
+
+#include "test.h"
+#include "../pagemap.h"
+#include "../pages.h"
+#include "../internal.h"
+
+#if PAGEMAP_IMPL != PAGEMAP_RADIX || PM_ADDR_BITS != 57
+#error "pagemap_test needs PAGEMAP_IMPL=1 PM_ADDR_BITS=57"
+#endif
+
+// pages above 2^47 round trip, without aliasing pages that only differ in
+//  bit 48, as 48-bit keys would
+// entries are only stored in the map, no memory is mapped there
+static void TestHighAddresses()
+{
+    char* const addrs[] = {
+        (char*)((size_t)1 << 47),
+        (char*)((size_t)1 << 52) + 5 * PAGE,
+        (char*)((size_t)1 << PM_ADDR_BITS) - PAGE,
+    };
+
+    int64_t size = 8 * PAGE;
+    for (char* addr : addrs)
+    {
+        sPageMap.SetPageInfo(addr, PageInfo(size | PI_CLEAN_FLAG));
+        PageInfo info = sPageMap.GetPageInfo(addr);
+        CHECK(info.GetSize() == size);
+        CHECK(info.IsClean());
+        CHECK(sPageMap.GetPageInfo((char*)((size_t)addr ^ ((size_t)1 << 48))).size == 0);
+        CHECK(sPageMap.GetPageInfo(addr - PAGE).size == 0);
+
+        CHECK(sPageMap.UpdatePageInfo(addr, info, PageInfo(-size)));
+        CHECK(!sPageMap.UpdatePageInfo(addr, info, PageInfo(size)));
+        CHECK(sPageMap.GetPageInfo(addr).GetSize() == -size);
+        size += PAGE;
+    }
+
+    // low addresses are unaffected
+    CHECK(sPageMap.GetPageInfo((char*)((size_t)1 << 20)).size == 0);
+}
+
+static void TestAddressRange()
+{
+    size_t const limit = (size_t)1 << PM_ADDR_BITS;
+    CHECK(InAddressRange((void*)PAGE, PAGE));
+    CHECK(InAddressRange((void*)(limit - PAGE), PAGE));
+    CHECK(!InAddressRange((void*)(limit - PAGE), 2 * PAGE));
+    CHECK(!InAddressRange((void*)limit, PAGE));
+    CHECK(!InAddressRange((void*)((size_t)1 << 63), PAGE));
+    CHECK(!InAddressRange((void*)(-PAGE), 2 * PAGE));
+
+    // pages given by the OS are always trackable
+    void* ptr = PageAlloc(PAGE);
+    CHECK(ptr != nullptr && InAddressRange(ptr, PAGE));
+    PageFree(ptr, PAGE);
+    ptr = PageAllocChunk(HUGEPAGE);
+    CHECK(ptr != nullptr && InAddressRange(ptr, HUGEPAGE));
+    PageFree(ptr, HUGEPAGE);
+}
+
+// memory mapped above 2^47 is trackable as a block
+// kernels only map there when hinted, and with 5-level paging
+static void TestHighMapping()
+{
+    size_t const size = 4 * PAGE;
+    void* hint = (void*)((size_t)1 << 52);
+    void* ptr = mmap(hint, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (ptr == MAP_FAILED || ((size_t)ptr >> 47) == 0)
+    {
+        fprintf(stderr, "pagemap_test: kernel ignored high mmap hint, "
+                "skipping high mapping test\n");
+        if (ptr != MAP_FAILED)
+            munmap(ptr, size);
+
+        return;
+    }
+
+    // same check PageAlloc applies to its mappings
+    CHECK(InAddressRange(ptr, size));
+    memset(ptr, 0xFF, size);
+
+    TKey key(size, (char*)ptr);
+    SetBlock(key);
+    CHECK(GetPageInfoForPtr(key.address).GetSize() == (int64_t)size);
+    CHECK(GetPageInfoForPtr(key.address + size - PAGE).GetSize() == -(int64_t)size);
+    CHECK(GetPageInfoForPtr(key.address + PAGE).size == 0);
+    // 48-bit keys would have aliased this page
+    CHECK(GetPageInfoForPtr((char*)((size_t)ptr & (((size_t)1 << 48) - 1))).size == 0);
+
+    CHECK(!ClearBlock(key));
+    CHECK(GetPageInfoForPtr(key.address).size == 0);
+    munmap(ptr, size);
+}
+
+int main()
+{
+    sPageMap.Init();
+    TestHighAddresses();
+    TestAddressRange();
+    TestHighMapping();
+    return TEST_RESULT("pagemap_test");
+}
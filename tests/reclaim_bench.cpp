@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+// tree node reclamation schemes under a multithreaded alloc/free loop
+// built once per LFBSTREE_RECLAIM value, see Makefile
+// usage: reclaim_bench [threads] [ops per thread]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "../coa.h"
+#include "../lfbstree.h"
+
+// live blocks per thread, oldest is freed before each allocation
+#define BENCH_WINDOW 64
+// sample retired nodes after this many operations
+#define BENCH_SAMPLE_FREQ 256
+
+static std::atomic<size_t> sMaxRetired(0);
+
+static void Worker(size_t ops, uint64_t seed)
+{
+    // blocks bypass the thread cache, so every operation goes to the tree
+    coa_set_thread_cache_budget(0);
+
+    void* window[BENCH_WINDOW] = { };
+    uint64_t x = seed | 1U;
+    for (size_t i = 0; i < ops; ++i)
+    {
+        void*& slot = window[i % BENCH_WINDOW];
+        if (slot)
+            coa_free(slot);
+
+        // xorshift64, sizes spread over 1 to 64 pages
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        slot = coa_alloc(PAGE * (1 + x % 64));
+        *(volatile char*)slot = 1;
+
+        if (i % BENCH_SAMPLE_FREQ == 0)
+        {
+            size_t retired = coa_retired_nodes();
+            size_t max = sMaxRetired.load(std::memory_order_relaxed);
+            while (retired > max && !sMaxRetired.compare_exchange_weak(max, retired));
+        }
+    }
+
+    for (void* ptr : window)
+    {
+        if (ptr)
+            coa_free(ptr);
+    }
+
+    coa_thread_flush();
+}
+
+int main(int argc, char** argv)
+{
+    size_t numThreads = argc > 1 ? atol(argv[1]) : 4;
+    size_t ops = argc > 2 ? atol(argv[2]) : 200000;
+
+    coa_init();
+    // purging would dominate the loop
+    coa_set_purge_decay(-1);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t)
+        threads.emplace_back(Worker, ops, t + 1);
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%s: %zu threads, %.2f Mops/s, retired nodes max %zu end %zu\n",
+            LFBSTREE_RECLAIM == LFBSTREE_RECLAIM_EBR ? "ebr" : "hp",
+            numThreads, 2 * numThreads * ops / elapsed.count() / 1e6,
+            sMaxRetired.load(), coa_retired_nodes());
+    return 0;
+}
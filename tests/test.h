@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2019 Ricardo Leite. All rights reserved.
+ * Licenced under the MIT licence. See COPYING file in the project root for details.
+ */
+
+#ifndef __TEST_H
+#define __TEST_H
+
+#include <cstdio>
+
+// minimal test harness, tests return number of failed checks from main
+static int sNumFailures = 0;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                    __FILE__, __LINE__, #cond); \
+            sNumFailures++; \
+        } \
+    } \
+    while (0)
+
+#define TEST_RESULT(name) \
+    (fprintf(stderr, "%s: %s\n", name, sNumFailures ? "FAILED" : "ok"), \
+     sNumFailures)
+
+#endif // __TEST_H